@@ -33,6 +33,7 @@ NUM_PAGES equ 0x200 ; Number of memory pages
 	dw 0
 	dd 8
 
+	align 8, 0
 gdt:
 	; Null Descriptor
 	dw 0xFFFF ; Limit (low)
@@ -92,6 +93,7 @@ _start:
 	add edi, PAGE_SIZE
 	mov ebx, MEM_START
 	mov ecx, NUM_PAGES
+	align 16
 initPageTables:
 	mov [edi], ebx
 	add ebx, PAGE_SIZE
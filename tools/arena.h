@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 0x10
+#define ARENA_FIRST_CHUNK_SIZE 0x10000
+#define ARENA_MAX_CHUNK_SIZE 0x1000000
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *prev;	// Previously filled chunk
+	size_t             size;	// Usable bytes in data
+	size_t             used;	// Bytes handed out from data
+	char               data[];
+} ArenaChunk;
+
+// Bump allocator for memory that lives as long as the arena
+typedef struct Arena {
+	ArenaChunk *chunk;		// Chunk currently being allocated from
+	size_t      next_size;	// Size of the next chunk to request
+	size_t      bytes;		// Bytes currently handed out
+	size_t      reserved;	// Bytes currently held in chunks
+	size_t      chunks;		// Chunks currently held
+	size_t      peak;		// Largest value reserved has reached
+} Arena;
+
+void arenaInit(Arena *a) {
+	a->chunk = NULL;
+	a->next_size = ARENA_FIRST_CHUNK_SIZE;
+	a->bytes = 0;
+	a->reserved = 0;
+	a->chunks = 0;
+	a->peak = 0;
+}
+
+static inline size_t arenaRound(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// Starts a new chunk big enough for at least size bytes
+void arenaAddChunk(Arena *a, size_t size) {
+	size_t chunk_size = a->next_size;
+	while (chunk_size < size) chunk_size <<= 1;
+	if (a->next_size < ARENA_MAX_CHUNK_SIZE) {
+		a->next_size <<= 1;
+	}
+	ArenaChunk *c = malloc(sizeof(ArenaChunk) + chunk_size);
+	c->prev = a->chunk;
+	c->size = chunk_size;
+	c->used = 0;
+	a->chunk = c;
+	a->chunks++;
+	a->reserved += chunk_size;
+	if (a->reserved > a->peak) {
+		a->peak = a->reserved;
+	}
+}
+
+/*
+ * Allocates memory that is freed all at once by arenaFree or arenaReset
+ * Param a:    The arena to allocate from
+ * Param size: The number of bytes needed
+ * Returns:    Memory aligned to ARENA_ALIGN
+ */
+void* arenaAlloc(Arena *a, size_t size) {
+	size = arenaRound(size);
+	if (!a->chunk || a->chunk->size - a->chunk->used < size) {
+		arenaAddChunk(a, size);
+	}
+	void *ret = a->chunk->data + a->chunk->used;
+	a->chunk->used += size;
+	a->bytes += size;
+	return ret;
+}
+
+// Copies a string into the arena
+char* arenaCopy(Arena *a, char *d, size_t len) {
+	char *ret = arenaAlloc(a, len);
+	memcpy(ret, d, len);
+	return ret;
+}
+
+// Frees every chunk, leaving the arena empty but usable
+void arenaReset(Arena *a) {
+	while (a->chunk) {
+		ArenaChunk *prev = a->chunk->prev;
+		free(a->chunk);
+		a->chunk = prev;
+	}
+	size_t peak = a->peak;
+	arenaInit(a);
+	a->peak = peak;
+}
+
+void arenaFree(Arena *a) {
+	arenaReset(a);
+}
+
+void arenaPrintStats(Arena *a, FILE *f) {
+	fprintf(f, "Arena: %zu bytes allocated, %zu bytes reserved in %zu chunks, peak %zu bytes\n",
+	        a->bytes, a->reserved, a->chunks, a->peak);
+}
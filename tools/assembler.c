@@ -1,65 +1,188 @@
 #include <stdbool.h>
 #include <stdint.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
-#define EQUALS(left,right,size) ((left).len == (size) && !strncmp((left).d, (right), (size)))
+#include "arena.h"
+#include "perfect-hash.h"
+#include "source.h"
+#include "output.h"
+#include "timer.h"
 
-// Can represent either a block of multiple instructions
-// or a single control flow instruction
-typedef struct Block {
-	void   *next;		// Pointer to next block
-	void   *data;		// For multi-instruction blocks, the encoded instructions;
-	                    // For single instructions, the target label
-	size_t  capacity;	// Capacity of buffer pointed to by data
-	size_t  size;		// Size of the block
-	size_t  address;	// Starting address of the block
-	size_t  line_num;	// Line number for first instruction of the block
-	int32_t operand;	// Single instruction only: encoded operand
-	uint16_t opcode;	// Opcode of the instruction; BLOCK for a multi-instruction block
-	bool    long_mode;	// true for 64 bit mode, false for 32 bit mode
-} Block;
+#define EQUALS(left,right,size) ((left).len == (size) && !strncmp((left).d, (right), (size)))
 
 typedef struct String {
 	char   *d;
 	size_t  len;
 } String;
 
-typedef struct Label {
-	Block  *target;
-	char   *name;
-	size_t  name_len;
-} Label;
-
+// The encoded program. Every instruction whose size is known while parsing goes straight into
+// one code buffer; instructions whose size depends on the final layout (jumps) are fragments
+// that are inserted into the code at their offset when the program is written out.
+// Fragments and labels are stored as parallel arrays so the post-parse passes are linear scans.
+// The arrays grow by doubling with realloc rather than in the arena: only an arena's most recent
+// allocation can grow in place, so all but one of them would be copied and abandoned on every
+// doubling, and parallel runs free each chunk's program once it is merged.
+typedef struct Program {
+	uint8_t  *code;				// Bytes of every instruction except fragments
+	size_t    code_len;
+	size_t    code_capacity;
+
+	uint32_t *frag_offset;		// Offset in code the fragment is inserted at
+	uint32_t *frag_target;		// Label id of the jump target, or the fill byte (or ALIGN_NOP) of an alignment
+	uint32_t *frag_line;		// Source line of the fragment
+	uint16_t *frag_opcode;		// SHORT_JMP, NEAR_JMP, SHORT_JNZ or NEAR_JNZ, or the alignment in bytes
+	uint8_t  *frag_kind;		// FRAGMENT_JUMP or FRAGMENT_ALIGN
+	uint32_t *frag_shift;		// Filled in by relaxation: total size of the fragments before each one
+	size_t    num_frags;
+	size_t    frag_capacity;
+
+	uint32_t *label_offset;		// Offset in code of the label, or UNDEFINED_LABEL
+	uint32_t *label_fragment;	// Number of fragments before the label
+	uint32_t *label_line;		// Source line the label is defined on
+	uint32_t *label_symbol;		// Symbol id of the label's name
+	size_t    num_labels;
+	size_t    label_capacity;
+
+	// Only recorded for the listing (-l); every line that has tokens gets a record, in source order
+	uint32_t *line_number;		// Source line of the record
+	uint32_t *line_offset;		// Offset in code where the line's bytes start
+	uint32_t *line_fragment;	// Number of fragments before the line
+	size_t    num_lines;
+	size_t    line_capacity;
+} Program;
+
+#define SYMBOL_HASH_MULTIPLIER 0x9E3779B97F4A7C15
 
+/*
+ * Hashes a symbol name eight bytes at a time, with one multiply per word. Products only carry
+ * upwards, so the high half is folded back in: the maps index by the low bits.
+ */
 size_t hashString(char *d, size_t len) {
-	size_t hash = 5381;
-	for (size_t i = 0; i < len; i++) {
-		hash = ((hash << 5) + hash) + d[i];
+	uint64_t hash = len * SYMBOL_HASH_MULTIPLIER;
+	for (; len >= 8; d += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, d, 8);
+		hash = (hash ^ w) * SYMBOL_HASH_MULTIPLIER;
+	}
+	// The last bytes are gathered with fixed size loads, since a variable length copy goes through memory
+	uint64_t w = 0;
+	size_t shift = 0;
+	if (len & 4) {
+		uint32_t part;
+		memcpy(&part, d, 4);
+		w = part;
+		d += 4;
+		shift = 32;
 	}
-	return hash;
+	if (len & 2) {
+		uint16_t part;
+		memcpy(&part, d, 2);
+		w |= (uint64_t)part << shift;
+		d += 2;
+		shift += 16;
+	}
+	if (len & 1) {
+		w |= (uint64_t)(uint8_t)*d << shift;
+	}
+	hash = (hash ^ w) * SYMBOL_HASH_MULTIPLIER;
+	return hash ^ (hash >> 32);
 }
 
-#define DTYPE Label
-#define QTYPE String
-#define D_HASH(d) (hashString((d)->name, (d)->name_len))
-#define Q_HASH(q) (hashString((q)->d, (q)->len))
-#define DELETE(d) if ((d).name) {   \
-	free((d).name);                 \
-}
-#define VALID(d) ((d).name)
-#define EQ(d,q) (EQUALS((*q),(d).name,(d).name_len))
-#include "hash-map.h"
+// Mixes a symbol id like hashString mixes a word, so the low bits depend on every bit of the id
+static inline size_t symbolIdHash(uint32_t id) {
+	uint64_t hash = id * SYMBOL_HASH_MULTIPLIER;
+	return hash ^ (hash >> 32);
+}
+
+#ifdef STATS
+// Counters for --stats; only compiled into builds with -DSTATS
+typedef struct Stats {
+	size_t lines;
+	size_t mnemonics[0x20];		// Uses of each entry of mnemonics
+	size_t code_reallocs;
+	size_t fragment_reallocs;
+	size_t label_reallocs;
+	size_t relax_visits;		// Jumps taken off the relaxation worklist
+	size_t relax_widened;
+	size_t jumps_resolved;		// Backward jumps encoded while parsing
+	size_t jumps_near;			// Backward jumps known to be near while parsing
+	size_t label_operations;	// Label map lookups and insertions
+	size_t label_probes;
+	size_t label_resizes;
+	size_t symbol_operations;	// Symbol table lookups and insertions
+	size_t symbol_probes;
+	size_t symbol_resizes;
+} Stats;
+
+Stats stats;
+
+// Atomic so that worker threads can count too
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(field, n) {}
+#endif
+
+#define ON_PROBE(n) {STAT_ADD(symbol_operations, 1); STAT_ADD(symbol_probes, n);}
+#define ON_RESIZE() STAT_ADD(symbol_resizes, 1)
+#include "symbols.h"
+#include "lexer.h"
+
+// Encodes one mnemonic or directive; arg is the value given in the mnemonic table
+typedef int (*MnemonicHandler)(Token *operands, uint16_t arg);
+
+typedef struct Mnemonic {
+	char            *name;
+	MnemonicHandler  handler;
+	uint16_t         arg;	// Opcode or operand width passed through to the handler
+	uint8_t          flags;	// FLAGS_USED, FLAGS_KEPT or FLAGS_WRITTEN
+} Mnemonic;
+
+Mnemonic* findMnemonic(String *opcode);
+
+typedef struct Register {
+	char    *name;
+	int8_t   encoding;	// ModRM reg/rm value; 8 and up need REX.R or REX.B
+	int16_t  width;		// Width in bits
+	uint8_t  class;		// GENERAL_REG, SEGMENT_REG, CONTROL_REG, ...
+	uint8_t  rex;		// REX_OPTIONAL, REX_REQUIRED or REX_NEVER
+} Register;
+
+// A string instruction that rep can repeat
+typedef struct StringInstruction {
+	char    *name;
+	uint8_t  opcode;
+	int16_t  width;		// Operand width in bits
+} StringInstruction;
+
+typedef struct Label {
+	uint32_t  symbol;	// Symbol id of the label's name
+	uint32_t  id;		// Index of the label in the program's label arrays
+} Label;
 
-typedef struct Constant {
-	char   *name;
-	size_t  name_len;
-	ssize_t  val;
-} Constant;
 
 #undef DTYPE
-#define DTYPE Constant
+#undef QTYPE
+#undef D_HASH
+#undef Q_HASH
+#undef VALID
+#undef EQ
+#undef HASH_EQ
+#undef ON_PROBE
+#undef ON_RESIZE
+#define DTYPE Label
+#define QTYPE uint32_t
+// Symbol ids are dense, and a chunk's map can be smaller than the range of ids it holds, so ids are
+// scattered before they pick a slot; indexing by the id itself makes long runs collide. The mixing
+// is invertible, so comparing ids decides equality on its own.
+#define D_HASH(d) (symbolIdHash((d)->symbol))
+#define Q_HASH(q) (symbolIdHash(*(q)))
+#define VALID(d) ((d).symbol)
+#define EQ(d,q) ((d).symbol == *(q))
+#define HASH_EQ(stored,hash) (true)
+#define ON_PROBE(n) {STAT_ADD(label_operations, 1); STAT_ADD(label_probes, n);}
+#define ON_RESIZE() STAT_ADD(label_resizes, 1)
 #include "hash-map.h"
 
 #define SUCCESS 0
@@ -84,7 +207,20 @@ typedef struct Constant {
 #define R_X 5
 #define ET_EXEC 2
 
-#define BLOCK_START_SIZE 0x40
+#define CODE_START_SIZE 0x1000
+#define FRAGMENT_START_SIZE 0x100
+#define LABEL_START_SIZE 0x100
+#define LINE_START_SIZE 0x400
+#define LINES_PER_SYMBOL 8		// Used to presize the symbol table and label maps from the line count
+
+#define FRAGMENT_JUMP 0
+#define FRAGMENT_ALIGN 1	// Padding up to the next multiple of an alignment; its size depends on its address
+
+#define ALIGN_NOP UINT32_MAX	// Fill of an alignment padded with NOPs
+#define MAX_ALIGN 0x1000
+#define MAX_NOP_SIZE 9
+
+#define UNDEFINED_LABEL UINT32_MAX
 
 #define LABEL_MAP_START_SIZE 0x40
 #define LABEL_MAP_START_MASK 0x3F
@@ -92,13 +228,16 @@ typedef struct Constant {
 #define LABEL_RESIZE_SHIFT 2
 #define LABEL_RESIZE_MASK 3
 
-#define BLOCK 0
-
 #define SHORT_JMP 0xEB
 #define NEAR_JMP 0xE9
 
 #define SHORT_JNZ 0x75
-#define NEAR_JNZ 0x0F85
+#define NEAR_JNZ 0x850F
+
+#define SHORT_JUMP_SIZE 2
+#define NEAR_JMP_SIZE 5
+#define NEAR_JNZ_SIZE 6
+#define SHORT_JUMP_REACH 0x90	// Upper bound on the distance between a short jump and any instruction in its span
 
 #define MOV_R_CR 0x200F
 #define MOV_CR_R 0x220F
@@ -114,6 +253,7 @@ typedef struct Constant {
 #define MOVB_I 0xB0
 #define MOVW_I 0xB8
 #define MOVL_I 0xB8
+#define MOVL_RM_I 0xC7	// Sign extended imm32, for a 64 bit destination
 
 #define STB_I 0xC6
 #define STW_I 0xC7
@@ -122,6 +262,7 @@ typedef struct Constant {
 #define IB 0x80
 #define IW 0x81
 #define IL 0x81
+#define IB_SX 0x83	// imm8 sign extended to the width of a 16 or 32 bit destination
 
 #define REG_DEST 0xC0
 
@@ -130,14 +271,26 @@ typedef struct Constant {
 #define AND 0x20
 #define XOR 0x30
 
-#define DEC 0x48
+#define DEC 0x48		// 32 bit mode only
+#define DECB_RM 0xFE
+#define DECL_RM 0xFF
+#define DEC_EXTENSION 1
 
 #define RDMSR 0x320f
 #define WRMSR 0x300f
 
-#define REP_STOSB 0xAAF3
-#define REP_STOSW 0xABF3
-#define REP_STOSD 0xABF3
+#define REP 0xF3
+#define STOSB 0xAA
+#define STOSL 0xAB
+#define MOVSB 0xA4
+#define MOVSL 0xA5
+
+#define OPERAND_SIZE 0x66
+#define ADDRESS_SIZE 0x67
+#define REX 0x40
+#define REX_W 8
+#define REX_R 4
+#define REX_B 1
 
 #define L 1
 
@@ -147,9 +300,33 @@ typedef struct Constant {
 
 #define DIRECT 0xC0
 #define INDIRECT 0
+#define DISP8 0x40
+#define RM_SIB 4		// rm value that means a SIB byte follows
+#define RM_DISP32 5		// rm value that means a 32 bit displacement with no base
+#define SIB_NO_INDEX 0x24	// SIB byte with base esp and no index
 
 #define INVALID_REGISTER -1
 
+// How an instruction affects the flags, for deciding where flag clobbering encodings are safe
+#define FLAGS_USED 0		// Reads the flags, or might lead to code that does
+#define FLAGS_KEPT 1		// Leaves the flags unchanged
+#define FLAGS_WRITTEN 2		// Sets ZF, the only flag any supported instruction reads
+
+#define FLAGS_LOOKAHEAD 8	// Lines searched for the instruction that next reads or writes the flags
+
+#define GENERAL_REG 0
+#define SEGMENT_REG 1
+#define CONTROL_REG 2
+#define DEBUG_REG 3
+#define X87_REG 4
+#define MMX_REG 5
+#define XMM_REG 6
+#define YMM_REG 7
+
+#define REX_OPTIONAL 0	// Encodable with or without a REX prefix
+#define REX_REQUIRED 1	// Only encodable with a REX prefix
+#define REX_NEVER 2		// Not encodable when a REX prefix is present
+
 #define MAX(a,b) ((a)<(b) ? (b) : (a));
 
 typedef struct ElfHeader {
@@ -188,841 +365,2061 @@ typedef struct ElfProgramHeader {
 	uint64_t    align;
 } ElfProgramHeader;
 
-ConstantMap constants;
+SymbolTable symbols;		// Every identifier in the source, and the value of each constant
 char *infile_name = NULL;
-size_t line_num = 0;
-bool long_mode = true;
-Block *curr_block = NULL;
+PhaseTimer timer;
+bool optimize = false;	// Choose the shortest encoding of each instruction (-O)
+bool keep_lines = false;	// Record where each line's code starts, for the listing (-l)
+
+// Encoding state; in parallel mode every worker thread encodes its chunk into its own copy
+_Thread_local LabelMap labels;
+_Thread_local Program program;
+_Thread_local size_t line_num = 0;
+_Thread_local bool long_mode = true;
+_Thread_local FILE *diagnostics;	// Where errors are reported; buffered per chunk in parallel mode
 
 /*
- * Reads an identifier from a character buffer, ignoring whitespace
- * Param buffer: character buffer that the identifier is read from
-                 (must be null or space terminated to avoid index out of bounds errors)
- * Param id:     output variable that will be set to the identifier
- * Returns:      The number of skipped whitespace characters at the front of buffer
-*/
-size_t getIdentifier(char *buffer, String *id) {
-	size_t ret = 0;
-	for (id->d = buffer; isspace(*id->d); id->d++) ret++;
-	for (id->len = 0;
-	     id->d[id->len] && (isalnum(id->d[id->len]) || id->d[id->len] == '_');
-		 id->len++);
-	return ret;
+ * Checks the type of a token, reporting a syntax error if it is not the expected one
+ * Param t:    The token to check
+ * Param type: The expected token type
+ * Param what: Description of the expected token for the error message
+ * Returns:    true if the token has the expected type
+ */
+bool expectToken(Token *t, uint8_t type, char *what) {
+	if (t->type != type) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Expected %s\n", infile_name, line_num, what);
+		return false;
+	}
+	return true;
+}
+
+// Whether a value can be encoded in an immediate of the given width, as either a signed or unsigned number
+static inline bool fitsWidth(int64_t val, int16_t bits) {
+	if (bits <= 0 || bits >= 64) {
+		return true;
+	}
+	return val >= -((int64_t)1 << (bits - 1)) && val <= ((int64_t)1 << bits) - 1;
+}
+
+// Whether an immediate, truncated to a destination of the given width, can be encoded as a sign extended byte
+static inline bool fitsSignExtendedByte(int64_t val, int16_t bits) {
+	int64_t truncated = bits >= 64 ? val : (int64_t)((uint64_t)val << (64 - bits)) >> (64 - bits);
+	return truncated >= INT8_MIN && truncated <= INT8_MAX;
 }
 
-Block* makeRoom(size_t size) {
-	if (curr_block->opcode != BLOCK) {
-		Block *n = malloc(sizeof(Block));
-		n->next = NULL;
-		n->data = malloc(BLOCK_START_SIZE);
-		n->capacity = BLOCK_START_SIZE;
-		n->address = curr_block->address + curr_block->size;
-		n->size = 0;
-		n->opcode = BLOCK;
-		n->line_num = line_num;
-		curr_block->next = n;
-		return n;
-	}
-	else if (curr_block->capacity < curr_block->size + size) {
-		size_t new_capacity = MAX(curr_block->capacity << 1, BLOCK_START_SIZE);
-		curr_block->data = realloc(curr_block->data, new_capacity);
-		curr_block->capacity = new_capacity;
-	}
-	return curr_block;
-}
-
-size_t setJmpOperand() {
-	Block *target = (Block*)(curr_block->data);
-	curr_block->operand = target->address - curr_block->address - curr_block->size;
-	int16_t op = curr_block->opcode;
-	if (curr_block->operand > INT8_MAX && (op == SHORT_JMP || op == SHORT_JNZ)) {
-		size_t ret;
-		if (op == SHORT_JMP) {
-			ret = curr_block->long_mode ? 3 : 1;
-			curr_block->opcode = NEAR_JMP;
+/*
+ * Finds the value of an immediate operand
+ * Param t:    A constant name or numeric literal
+ * Param val:  Output variable that will be set to the value of the operand
+ * Param bits: Width of the immediate the value will be encoded in
+ * Returns:    SUCCESS, ERROR if t is not a defined constant or a literal, or SYNTAX_ERROR
+ *             if t is a malformed literal or a literal that does not fit in bits (reported here)
+ */
+int immediateValue(Token *t, int64_t *val, int16_t bits) {
+	if (t->type == TOKEN_NUMBER) {
+		if (!parseNumber(&t->s, val)) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid number \"%.*s\"\n",
+			        infile_name, line_num, (int)t->s.len, t->s.d);
+			return SYNTAX_ERROR;
 		}
-		else {
-			ret = curr_block->long_mode ? 4 : 2;
-			curr_block->opcode = NEAR_JNZ;
+		if (!fitsWidth(*val, bits)) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Number \"%.*s\" does not fit in %hi bits\n",
+			        infile_name, line_num, (int)t->s.len, t->s.d, bits);
+			return SYNTAX_ERROR;
 		}
-		curr_block->size += ret;
-		return ret;
+		return SUCCESS;
 	}
-	return 0;
+	else if (t->type == TOKEN_IDENTIFIER) {
+		// Constants are 64 bit values and are truncated to the width of the immediate
+		uint32_t line = symbols.constant_line[t->symbol];
+		if (line && line < line_num) {
+			*val = symbols.constant_value[t->symbol];
+			return SUCCESS;
+		}
+	}
+	return ERROR;
 }
 
-int16_t getRegisterWidth(String *r) {
-	size_t len = r->len;
-	char first_char = *(r->d);
-	char last_char = r->d[len-1];
-	if (last_char == 'l' || last_char == 'h') {
-		return 8;
-	}
-	else if (last_char == 'w' || len == 2) {
-		return 16;
+/*
+ * Finds the value of an instruction's immediate operand. 64 bit operations take a 32 bit immediate
+ * that is sign extended, so a literal or constant must fit in a signed 32 bit value; truncating it
+ * would change the value.
+ * Param t:     A constant name or numeric literal
+ * Param val:   Output variable that will be set to the value of the operand
+ * Param width: Width of the operation
+ * Returns:     SUCCESS, ERROR if t is not an immediate, or SYNTAX_ERROR (reported here)
+ */
+int immediateOperand(Token *t, int64_t *val, int16_t width) {
+	int status = immediateValue(t, val, width);
+	if (status == SUCCESS && width == 64 && (*val < INT32_MIN || *val > INT32_MAX)) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): %s \"%.*s\" does not fit in a sign extended 32 bit immediate\n",
+		        infile_name, line_num, t->type == TOKEN_NUMBER ? "Number" : "Constant", (int)t->s.len, t->s.d);
+		return SYNTAX_ERROR;
 	}
-	else if (first_char == 'e' || last_char == 'd' || first_char == 'c' || first_char == 'd') {
-		return 32;
+	return status;
+}
+
+size_t countLines(char *d, size_t len) {
+	size_t lines = 0;
+	for (char *end = d + len; (d = memchr(d, '\n', end - d)); d++) {
+		lines++;
 	}
-	else if (first_char == 'r' || first_char == 'm') {
-		return 64;
+	return lines;
+}
+
+void programInit(Program *p) {
+	memset(p, 0, sizeof(Program));
+	p->code_capacity = CODE_START_SIZE;
+	p->code = malloc(p->code_capacity);
+	p->frag_capacity = FRAGMENT_START_SIZE;
+	p->frag_offset = malloc(p->frag_capacity * sizeof(uint32_t));
+	p->frag_target = malloc(p->frag_capacity * sizeof(uint32_t));
+	p->frag_line = malloc(p->frag_capacity * sizeof(uint32_t));
+	p->frag_opcode = malloc(p->frag_capacity * sizeof(uint16_t));
+	p->frag_kind = malloc(p->frag_capacity * sizeof(uint8_t));
+	p->label_capacity = LABEL_START_SIZE;
+	p->label_offset = malloc(p->label_capacity * sizeof(uint32_t));
+	p->label_fragment = malloc(p->label_capacity * sizeof(uint32_t));
+	p->label_line = malloc(p->label_capacity * sizeof(uint32_t));
+	p->label_symbol = malloc(p->label_capacity * sizeof(uint32_t));
+}
+
+void programFree(Program *p) {
+	free(p->code);
+	free(p->frag_offset);
+	free(p->frag_target);
+	free(p->frag_line);
+	free(p->frag_opcode);
+	free(p->frag_kind);
+	free(p->frag_shift);
+	free(p->label_offset);
+	free(p->label_fragment);
+	free(p->label_line);
+	free(p->label_symbol);
+	free(p->line_number);
+	free(p->line_offset);
+	free(p->line_fragment);
+}
+
+/*
+ * Reserves space at the end of the code buffer for an instruction
+ * Param size: The size of the instruction
+ * Returns:    Where to write the instruction
+ */
+static inline uint8_t* emitCode(size_t size) {
+	if (program.code_len + size > program.code_capacity) {
+		while (program.code_len + size > program.code_capacity) program.code_capacity <<= 1;
+		STAT_ADD(code_reallocs, 1);
+		program.code = realloc(program.code, program.code_capacity);
 	}
-	else if (first_char == 's') {
-		return 80;
+	uint8_t *ret = program.code + program.code_len;
+	program.code_len += size;
+	return ret;
+}
+
+/*
+ * Appends a fragment at the current end of the code buffer
+ * Param kind:   FRAGMENT_JUMP or FRAGMENT_ALIGN
+ * Param opcode: The opcode of the jump, or the alignment
+ * Param target: Label id of the jump target, or the fill of the alignment
+ */
+void addFragment(uint8_t kind, uint16_t opcode, uint32_t target) {
+	Program *p = &program;
+	if (p->num_frags == p->frag_capacity) {
+		p->frag_capacity <<= 1;
+		STAT_ADD(fragment_reallocs, 1);
+		p->frag_offset = realloc(p->frag_offset, p->frag_capacity * sizeof(uint32_t));
+		p->frag_target = realloc(p->frag_target, p->frag_capacity * sizeof(uint32_t));
+		p->frag_line = realloc(p->frag_line, p->frag_capacity * sizeof(uint32_t));
+		p->frag_opcode = realloc(p->frag_opcode, p->frag_capacity * sizeof(uint16_t));
+		p->frag_kind = realloc(p->frag_kind, p->frag_capacity * sizeof(uint8_t));
 	}
-	else if (first_char == 'x') {
-		return 128;
+	size_t i = p->num_frags++;
+	p->frag_offset[i] = p->code_len;
+	p->frag_target[i] = target;
+	p->frag_line[i] = line_num;
+	p->frag_opcode[i] = opcode;
+	p->frag_kind[i] = kind;
+}
+
+static inline size_t fragmentSize(uint16_t opcode) {
+	switch (opcode) {
+		case NEAR_JMP: return NEAR_JMP_SIZE;
+		case NEAR_JNZ: return NEAR_JNZ_SIZE;
+		default: return SHORT_JUMP_SIZE;
 	}
-	else if (first_char == 'y') {
-		return 256;
+}
+
+static inline uint16_t nearJump(uint16_t opcode) {
+	return opcode == SHORT_JMP ? NEAR_JMP : NEAR_JNZ;
+}
+
+static inline uint16_t shortJump(uint16_t opcode) {
+	return opcode == SHORT_JMP || opcode == NEAR_JMP ? SHORT_JMP : SHORT_JNZ;
+}
+
+// Writes a jump of fragmentSize(opcode) bytes with the given displacement
+static inline void writeJump(uint8_t *out, uint16_t opcode, int32_t operand) {
+	size_t size = fragmentSize(opcode);
+	if (opcode == SHORT_JMP || opcode == SHORT_JNZ) {
+		out[0] = opcode;
+		out[1] = operand;
 	}
 	else {
-		return INVALID_REGISTER;
+		memcpy(out, &opcode, size - sizeof(int32_t));
+		memcpy(out + size - sizeof(int32_t), &operand, sizeof(int32_t));
 	}
 }
 
-int8_t encodeRegister(String *r) {
-	if (EQUALS(*r,"al",2) || EQUALS(*r,"ax",2) || EQUALS(*r,"eax",3) || EQUALS(*r,"rax",3) || EQUALS(*r,"st0",3)
-	 || EQUALS(*r,"mmx0",4) || EQUALS(*r,"xmm0",4) || EQUALS(*r,"ymm0",4) || EQUALS(*r,"es",2) || EQUALS(*r,"cr0",3) || EQUALS(*r,"dr0",3)) {
-		return 0;
+/*
+ * Appends a line record for the listing
+ * Param line:     The source line
+ * Param offset:   Offset in code where the line's bytes start
+ * Param fragment: Number of fragments before the line
+ */
+void addLine(uint32_t line, uint32_t offset, uint32_t fragment) {
+	Program *p = &program;
+	if (p->num_lines == p->line_capacity) {
+		p->line_capacity = p->line_capacity ? p->line_capacity << 1 : LINE_START_SIZE;
+		p->line_number = realloc(p->line_number, p->line_capacity * sizeof(uint32_t));
+		p->line_offset = realloc(p->line_offset, p->line_capacity * sizeof(uint32_t));
+		p->line_fragment = realloc(p->line_fragment, p->line_capacity * sizeof(uint32_t));
 	}
-	else if (EQUALS(*r,"cl",2) || EQUALS(*r,"cx",2) || EQUALS(*r,"ecx",3) || EQUALS(*r,"rcx",3) || EQUALS(*r,"st1",3)
-	 || EQUALS(*r,"mmx1",4) || EQUALS(*r,"xmm1",4) || EQUALS(*r,"ymm1",4) || EQUALS(*r,"cs",2) || EQUALS(*r,"cr1",3) || EQUALS(*r,"dr1",3)) {
-		return 1;
+	size_t i = p->num_lines++;
+	p->line_number[i] = line;
+	p->line_offset[i] = offset;
+	p->line_fragment[i] = fragment;
+}
+
+/*
+ * Finds the id of a label, creating an undefined label the first time a name is seen
+ * Param symbol: Symbol id of the label's name
+ * Returns:      The label's id
+ */
+uint32_t labelId(uint32_t symbol) {
+	Label *lab = LabelMapGet(&labels, &symbol);
+	if (lab) {
+		return lab->id;
 	}
-	else if (EQUALS(*r,"dl",2) || EQUALS(*r,"dx",2) || EQUALS(*r,"edx",3) || EQUALS(*r,"rdx",3) || EQUALS(*r,"st2",3)
-	 || EQUALS(*r,"mmx2",4) || EQUALS(*r,"xmm2",4) || EQUALS(*r,"ymm2",4) || EQUALS(*r,"ss",2) || EQUALS(*r,"cr2",3) || EQUALS(*r,"dr2",3)) {
-		return 2;
+	Program *p = &program;
+	if (p->num_labels == p->label_capacity) {
+		p->label_capacity <<= 1;
+		STAT_ADD(label_reallocs, 1);
+		p->label_offset = realloc(p->label_offset, p->label_capacity * sizeof(uint32_t));
+		p->label_fragment = realloc(p->label_fragment, p->label_capacity * sizeof(uint32_t));
+		p->label_line = realloc(p->label_line, p->label_capacity * sizeof(uint32_t));
+		p->label_symbol = realloc(p->label_symbol, p->label_capacity * sizeof(uint32_t));
 	}
-	else if (EQUALS(*r,"bl",2) || EQUALS(*r,"bx",2) || EQUALS(*r,"ebx",3) || EQUALS(*r,"rbx",3) || EQUALS(*r,"st3",3)
-	 || EQUALS(*r,"mmx3",4) || EQUALS(*r,"xmm3",4) || EQUALS(*r,"ymm3",4) || EQUALS(*r,"ds",2) || EQUALS(*r,"cr3",3) || EQUALS(*r,"dr3",3)) {
-		return 3;
+	Label new_label;
+	new_label.symbol = symbol;
+	uint32_t id = p->num_labels++;
+	new_label.id = id;
+	p->label_offset[id] = UNDEFINED_LABEL;
+	p->label_symbol[id] = symbol;
+	p->label_line[id] = line_num;
+	// Insertion may swap new_label with entries it displaces
+	LabelMapInsert(&labels, &new_label);
+	return id;
+}
+
+/*
+ * Defines a label at the current end of the code buffer
+ * Param symbol: Symbol id of the label's name
+ * Returns:      SUCCESS, or SEMANTIC_ERROR if the label was already defined
+ */
+int defineLabel(uint32_t symbol) {
+	uint32_t id = labelId(symbol);
+	if (program.label_offset[id] != UNDEFINED_LABEL) {
+		String *name = symbols.names + symbol;
+		fprintf(diagnostics, "Assembler Error (%s:%lu): label \"%.*s\" is already defined\n",
+		        infile_name, line_num, (int)name->len, name->d);
+		return SEMANTIC_ERROR;
 	}
-	else if (EQUALS(*r,"ah",2) || EQUALS(*r,"spl",3) || EQUALS(*r,"sp",2) || EQUALS(*r,"esp",3) || EQUALS(*r,"rsp",3) || EQUALS(*r,"st4",3)
-	 || EQUALS(*r,"mmx4",4) || EQUALS(*r,"xmm4",4) || EQUALS(*r,"ymm4",4) || EQUALS(*r,"fs",2) || EQUALS(*r,"cr4",3) || EQUALS(*r,"dr4",3)) {
-		return 4;
+	program.label_offset[id] = program.code_len;
+	program.label_fragment[id] = program.num_frags;
+	program.label_line[id] = line_num;
+	return SUCCESS;
+}
+
+/*
+ * Every register the assembler knows about, looked up through a perfect hash of the name.
+ * encoding is the value of the ModRM reg/rm field, plus 8 for registers that need REX.R or REX.B.
+ */
+Register registers[] = {
+	{"al",   0,  8, GENERAL_REG, REX_OPTIONAL}, {"cl",   1,  8, GENERAL_REG, REX_OPTIONAL},
+	{"dl",   2,  8, GENERAL_REG, REX_OPTIONAL}, {"bl",   3,  8, GENERAL_REG, REX_OPTIONAL},
+	{"ah",   4,  8, GENERAL_REG, REX_NEVER},    {"ch",   5,  8, GENERAL_REG, REX_NEVER},
+	{"dh",   6,  8, GENERAL_REG, REX_NEVER},    {"bh",   7,  8, GENERAL_REG, REX_NEVER},
+	{"spl",  4,  8, GENERAL_REG, REX_REQUIRED}, {"bpl",  5,  8, GENERAL_REG, REX_REQUIRED},
+	{"sil",  6,  8, GENERAL_REG, REX_REQUIRED}, {"dil",  7,  8, GENERAL_REG, REX_REQUIRED},
+	{"ax",   0, 16, GENERAL_REG, REX_OPTIONAL}, {"cx",   1, 16, GENERAL_REG, REX_OPTIONAL},
+	{"dx",   2, 16, GENERAL_REG, REX_OPTIONAL}, {"bx",   3, 16, GENERAL_REG, REX_OPTIONAL},
+	{"sp",   4, 16, GENERAL_REG, REX_OPTIONAL}, {"bp",   5, 16, GENERAL_REG, REX_OPTIONAL},
+	{"si",   6, 16, GENERAL_REG, REX_OPTIONAL}, {"di",   7, 16, GENERAL_REG, REX_OPTIONAL},
+	{"eax",  0, 32, GENERAL_REG, REX_OPTIONAL}, {"ecx",  1, 32, GENERAL_REG, REX_OPTIONAL},
+	{"edx",  2, 32, GENERAL_REG, REX_OPTIONAL}, {"ebx",  3, 32, GENERAL_REG, REX_OPTIONAL},
+	{"esp",  4, 32, GENERAL_REG, REX_OPTIONAL}, {"ebp",  5, 32, GENERAL_REG, REX_OPTIONAL},
+	{"esi",  6, 32, GENERAL_REG, REX_OPTIONAL}, {"edi",  7, 32, GENERAL_REG, REX_OPTIONAL},
+	{"rax",  0, 64, GENERAL_REG, REX_OPTIONAL}, {"rcx",  1, 64, GENERAL_REG, REX_OPTIONAL},
+	{"rdx",  2, 64, GENERAL_REG, REX_OPTIONAL}, {"rbx",  3, 64, GENERAL_REG, REX_OPTIONAL},
+	{"rsp",  4, 64, GENERAL_REG, REX_OPTIONAL}, {"rbp",  5, 64, GENERAL_REG, REX_OPTIONAL},
+	{"rsi",  6, 64, GENERAL_REG, REX_OPTIONAL}, {"rdi",  7, 64, GENERAL_REG, REX_OPTIONAL},
+
+	{"r8b",  8,  8, GENERAL_REG, REX_REQUIRED}, {"r8l",  8,  8, GENERAL_REG, REX_REQUIRED},
+	{"r8w",  8, 16, GENERAL_REG, REX_REQUIRED}, {"r8d",  8, 32, GENERAL_REG, REX_REQUIRED},
+	{"r8",   8, 64, GENERAL_REG, REX_REQUIRED},
+	{"r9b",  9,  8, GENERAL_REG, REX_REQUIRED}, {"r9l",  9,  8, GENERAL_REG, REX_REQUIRED},
+	{"r9w",  9, 16, GENERAL_REG, REX_REQUIRED}, {"r9d",  9, 32, GENERAL_REG, REX_REQUIRED},
+	{"r9",   9, 64, GENERAL_REG, REX_REQUIRED},
+	{"r10b", 10, 8, GENERAL_REG, REX_REQUIRED}, {"r10l", 10, 8, GENERAL_REG, REX_REQUIRED},
+	{"r10w", 10, 16, GENERAL_REG, REX_REQUIRED}, {"r10d", 10, 32, GENERAL_REG, REX_REQUIRED},
+	{"r10",  10, 64, GENERAL_REG, REX_REQUIRED},
+	{"r11b", 11, 8, GENERAL_REG, REX_REQUIRED}, {"r11l", 11, 8, GENERAL_REG, REX_REQUIRED},
+	{"r11w", 11, 16, GENERAL_REG, REX_REQUIRED}, {"r11d", 11, 32, GENERAL_REG, REX_REQUIRED},
+	{"r11",  11, 64, GENERAL_REG, REX_REQUIRED},
+	{"r12b", 12, 8, GENERAL_REG, REX_REQUIRED}, {"r12l", 12, 8, GENERAL_REG, REX_REQUIRED},
+	{"r12w", 12, 16, GENERAL_REG, REX_REQUIRED}, {"r12d", 12, 32, GENERAL_REG, REX_REQUIRED},
+	{"r12",  12, 64, GENERAL_REG, REX_REQUIRED},
+	{"r13b", 13, 8, GENERAL_REG, REX_REQUIRED}, {"r13l", 13, 8, GENERAL_REG, REX_REQUIRED},
+	{"r13w", 13, 16, GENERAL_REG, REX_REQUIRED}, {"r13d", 13, 32, GENERAL_REG, REX_REQUIRED},
+	{"r13",  13, 64, GENERAL_REG, REX_REQUIRED},
+	{"r14b", 14, 8, GENERAL_REG, REX_REQUIRED}, {"r14l", 14, 8, GENERAL_REG, REX_REQUIRED},
+	{"r14w", 14, 16, GENERAL_REG, REX_REQUIRED}, {"r14d", 14, 32, GENERAL_REG, REX_REQUIRED},
+	{"r14",  14, 64, GENERAL_REG, REX_REQUIRED},
+	{"r15b", 15, 8, GENERAL_REG, REX_REQUIRED}, {"r15l", 15, 8, GENERAL_REG, REX_REQUIRED},
+	{"r15w", 15, 16, GENERAL_REG, REX_REQUIRED}, {"r15d", 15, 32, GENERAL_REG, REX_REQUIRED},
+	{"r15",  15, 64, GENERAL_REG, REX_REQUIRED},
+
+	{"es",   0, 16, SEGMENT_REG, REX_OPTIONAL}, {"cs",   1, 16, SEGMENT_REG, REX_OPTIONAL},
+	{"ss",   2, 16, SEGMENT_REG, REX_OPTIONAL}, {"ds",   3, 16, SEGMENT_REG, REX_OPTIONAL},
+	{"fs",   4, 16, SEGMENT_REG, REX_OPTIONAL}, {"gs",   5, 16, SEGMENT_REG, REX_OPTIONAL},
+
+	{"st0",  0, 80, X87_REG, REX_NEVER}, {"st1",  1, 80, X87_REG, REX_NEVER},
+	{"st2",  2, 80, X87_REG, REX_NEVER}, {"st3",  3, 80, X87_REG, REX_NEVER},
+	{"st4",  4, 80, X87_REG, REX_NEVER}, {"st5",  5, 80, X87_REG, REX_NEVER},
+	{"st6",  6, 80, X87_REG, REX_NEVER}, {"st7",  7, 80, X87_REG, REX_NEVER},
+
+	{"mm0",  0, 64, MMX_REG, REX_NEVER}, {"mm1",  1, 64, MMX_REG, REX_NEVER},
+	{"mm2",  2, 64, MMX_REG, REX_NEVER}, {"mm3",  3, 64, MMX_REG, REX_NEVER},
+	{"mm4",  4, 64, MMX_REG, REX_NEVER}, {"mm5",  5, 64, MMX_REG, REX_NEVER},
+	{"mm6",  6, 64, MMX_REG, REX_NEVER}, {"mm7",  7, 64, MMX_REG, REX_NEVER},
+
+	{"xmm0",  0, 128, XMM_REG, REX_OPTIONAL}, {"xmm1",  1, 128, XMM_REG, REX_OPTIONAL},
+	{"xmm2",  2, 128, XMM_REG, REX_OPTIONAL}, {"xmm3",  3, 128, XMM_REG, REX_OPTIONAL},
+	{"xmm4",  4, 128, XMM_REG, REX_OPTIONAL}, {"xmm5",  5, 128, XMM_REG, REX_OPTIONAL},
+	{"xmm6",  6, 128, XMM_REG, REX_OPTIONAL}, {"xmm7",  7, 128, XMM_REG, REX_OPTIONAL},
+	{"xmm8",  8, 128, XMM_REG, REX_REQUIRED}, {"xmm9",  9, 128, XMM_REG, REX_REQUIRED},
+	{"xmm10", 10, 128, XMM_REG, REX_REQUIRED}, {"xmm11", 11, 128, XMM_REG, REX_REQUIRED},
+	{"xmm12", 12, 128, XMM_REG, REX_REQUIRED}, {"xmm13", 13, 128, XMM_REG, REX_REQUIRED},
+	{"xmm14", 14, 128, XMM_REG, REX_REQUIRED}, {"xmm15", 15, 128, XMM_REG, REX_REQUIRED},
+
+	{"ymm0",  0, 256, YMM_REG, REX_OPTIONAL}, {"ymm1",  1, 256, YMM_REG, REX_OPTIONAL},
+	{"ymm2",  2, 256, YMM_REG, REX_OPTIONAL}, {"ymm3",  3, 256, YMM_REG, REX_OPTIONAL},
+	{"ymm4",  4, 256, YMM_REG, REX_OPTIONAL}, {"ymm5",  5, 256, YMM_REG, REX_OPTIONAL},
+	{"ymm6",  6, 256, YMM_REG, REX_OPTIONAL}, {"ymm7",  7, 256, YMM_REG, REX_OPTIONAL},
+	{"ymm8",  8, 256, YMM_REG, REX_REQUIRED}, {"ymm9",  9, 256, YMM_REG, REX_REQUIRED},
+	{"ymm10", 10, 256, YMM_REG, REX_REQUIRED}, {"ymm11", 11, 256, YMM_REG, REX_REQUIRED},
+	{"ymm12", 12, 256, YMM_REG, REX_REQUIRED}, {"ymm13", 13, 256, YMM_REG, REX_REQUIRED},
+	{"ymm14", 14, 256, YMM_REG, REX_REQUIRED}, {"ymm15", 15, 256, YMM_REG, REX_REQUIRED},
+
+	{"cr0",  0, 32, CONTROL_REG, REX_OPTIONAL}, {"cr1",  1, 32, CONTROL_REG, REX_OPTIONAL},
+	{"cr2",  2, 32, CONTROL_REG, REX_OPTIONAL}, {"cr3",  3, 32, CONTROL_REG, REX_OPTIONAL},
+	{"cr4",  4, 32, CONTROL_REG, REX_OPTIONAL}, {"cr5",  5, 32, CONTROL_REG, REX_OPTIONAL},
+	{"cr6",  6, 32, CONTROL_REG, REX_OPTIONAL}, {"cr7",  7, 32, CONTROL_REG, REX_OPTIONAL},
+	{"cr8",  8, 32, CONTROL_REG, REX_REQUIRED}, {"cr9",  9, 32, CONTROL_REG, REX_REQUIRED},
+	{"cr10", 10, 32, CONTROL_REG, REX_REQUIRED}, {"cr11", 11, 32, CONTROL_REG, REX_REQUIRED},
+	{"cr12", 12, 32, CONTROL_REG, REX_REQUIRED}, {"cr13", 13, 32, CONTROL_REG, REX_REQUIRED},
+	{"cr14", 14, 32, CONTROL_REG, REX_REQUIRED}, {"cr15", 15, 32, CONTROL_REG, REX_REQUIRED},
+
+	{"dr0",  0, 32, DEBUG_REG, REX_OPTIONAL}, {"dr1",  1, 32, DEBUG_REG, REX_OPTIONAL},
+	{"dr2",  2, 32, DEBUG_REG, REX_OPTIONAL}, {"dr3",  3, 32, DEBUG_REG, REX_OPTIONAL},
+	{"dr4",  4, 32, DEBUG_REG, REX_OPTIONAL}, {"dr5",  5, 32, DEBUG_REG, REX_OPTIONAL},
+	{"dr6",  6, 32, DEBUG_REG, REX_OPTIONAL}, {"dr7",  7, 32, DEBUG_REG, REX_OPTIONAL},
+	{"dr8",  8, 32, DEBUG_REG, REX_REQUIRED}, {"dr9",  9, 32, DEBUG_REG, REX_REQUIRED},
+	{"dr10", 10, 32, DEBUG_REG, REX_REQUIRED}, {"dr11", 11, 32, DEBUG_REG, REX_REQUIRED},
+	{"dr12", 12, 32, DEBUG_REG, REX_REQUIRED}, {"dr13", 13, 32, DEBUG_REG, REX_REQUIRED},
+	{"dr14", 14, 32, DEBUG_REG, REX_REQUIRED}, {"dr15", 15, 32, DEBUG_REG, REX_REQUIRED},
+};
+
+#define NUM_REGISTERS (sizeof(registers) / sizeof(Register))
+
+PerfectHash register_table;
+
+bool buildRegisterTable() {
+	uint64_t keys[NUM_REGISTERS];
+	for (size_t i = 0; i < NUM_REGISTERS; i++) {
+		keys[i] = packKey(registers[i].name, strlen(registers[i].name));
 	}
-	else if (EQUALS(*r,"ch",2) || EQUALS(*r,"bpl",3) || EQUALS(*r,"bp",2) || EQUALS(*r,"ebp",3) || EQUALS(*r,"rbp",3) || EQUALS(*r,"st5",3)
-	 || EQUALS(*r,"mmx5",4) || EQUALS(*r,"xmm5",4) || EQUALS(*r,"ymm5",4) || EQUALS(*r,"gs",2) || EQUALS(*r,"cr5",3) || EQUALS(*r,"dr5",3)) {
-		return 5;
+	return perfectHashBuild(&register_table, keys, NUM_REGISTERS);
+}
+
+/*
+ * Finds the descriptor for a register name
+ * Param r: The register name
+ * Returns: The descriptor, or NULL if r does not name a register
+ */
+Register* lookupRegister(String *r) {
+	int32_t i = perfectHashFind(&register_table, packKey(r->d, r->len));
+	return i < 0 ? NULL : registers + i;
+}
+
+/*
+ * Emits the prefixes an instruction needs before its opcode: operand size, address size and REX.
+ * Also rejects registers that cannot be encoded in the current mode or together.
+ * Param width:   The operand width, or 0 if the instruction has no operand size to override
+ * Param reg:     The register in the ModRM reg field, or NULL
+ * Param rm:      The register in the ModRM rm field or the opcode, or NULL
+ * Param address: Whether rm holds an address rather than an operand
+ * Returns:       true if the prefixes were emitted
+ */
+bool emitPrefixes(int16_t width, Register *reg, Register *rm, bool address) {
+	Register *operands[] = {reg, rm};
+	bool rex_required = false, rex_never = false;
+	for (size_t i = 0; i < 2; i++) {
+		Register *r = operands[i];
+		if (!r) {
+			continue;
+		}
+		if (!long_mode && (r->rex == REX_REQUIRED || (r->class == GENERAL_REG && r->width == 64))) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Register %s is only available in 64 bit mode\n",
+			        infile_name, line_num, r->name);
+			return false;
+		}
+		rex_required |= r->rex == REX_REQUIRED;
+		rex_never |= r->rex == REX_NEVER;
 	}
-	else if (EQUALS(*r,"dh",2) || EQUALS(*r,"sil",3) || EQUALS(*r,"si",2) || EQUALS(*r,"esi",3) || EQUALS(*r,"rsi",3) || EQUALS(*r,"st6",3)
-	 || EQUALS(*r,"mmx6",4) || EQUALS(*r,"xmm6",4) || EQUALS(*r,"ymm6",4) || EQUALS(*r,"cr6",3) || EQUALS(*r,"dr6",3)) {
-		return 6;
+	if (address && (rm->class != GENERAL_REG || rm->width < 32)) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid address register: %s\n", infile_name, line_num, rm->name);
+		return false;
 	}
-	else if (EQUALS(*r,"bh",2) || EQUALS(*r,"dil",3) || EQUALS(*r,"di",2) || EQUALS(*r,"edi",3) || EQUALS(*r,"rdi",3) || EQUALS(*r,"st7",3)
-	 || EQUALS(*r,"mmx7",4) || EQUALS(*r,"xmm7",4) || EQUALS(*r,"ymm7",4) || EQUALS(*r,"cr7",3) || EQUALS(*r,"dr7",3)) {
-		return 7;
+	if (width == 64 && !long_mode) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): 64 bit operands are only available in 64 bit mode\n",
+		        infile_name, line_num);
+		return false;
 	}
-	else if (EQUALS(*r,"r8l",3) || EQUALS(*r,"r8w",3) || EQUALS(*r,"r8d",3) || EQUALS(*r,"r8",2) 
-	 || EQUALS(*r,"mmx8",4) || EQUALS(*r,"xmm8",4) || EQUALS(*r,"ymm8",4) || EQUALS(*r,"cr8",3) || EQUALS(*r,"dr8",3)) {
-		return 8;
+
+	uint8_t rex = REX | (width == 64 ? REX_W : 0) | (reg && reg->encoding > 7 ? REX_R : 0)
+	              | (rm && rm->encoding > 7 ? REX_B : 0);
+	rex_required |= rex != REX;
+	if (rex_required && rex_never) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): ah, bh, ch and dh cannot be used with a REX prefix\n",
+		        infile_name, line_num);
+		return false;
 	}
-	else if (EQUALS(*r,"r9l",3) || EQUALS(*r,"r9w",3) || EQUALS(*r,"r9d",3) || EQUALS(*r,"r9",2) 
-	 || EQUALS(*r,"mmx9",4) || EQUALS(*r,"xmm9",4) || EQUALS(*r,"ymm9",4) || EQUALS(*r,"cr9",3) || EQUALS(*r,"dr9",3)) {
-		return 9;
+	bool address_size = address && long_mode && rm->width == 32;
+	uint8_t *code = emitCode((width == 16) + address_size + rex_required);
+	if (width == 16) {
+		*code++ = OPERAND_SIZE;
 	}
-	else if (EQUALS(*r,"r10l",3) || EQUALS(*r,"r10w",3) || EQUALS(*r,"r10d",3) || EQUALS(*r,"r10",2) 
-	 || EQUALS(*r,"mmx10",4) || EQUALS(*r,"xmm10",4) || EQUALS(*r,"ymm10",4) || EQUALS(*r,"cr10",3) || EQUALS(*r,"dr10",3)) {
-		return 10;
+	if (address_size) {
+		*code++ = ADDRESS_SIZE;
 	}
-	else if (EQUALS(*r,"r11l",3) || EQUALS(*r,"r11w",3) || EQUALS(*r,"r11d",3) || EQUALS(*r,"r11",2) 
-	 || EQUALS(*r,"mmx11",4) || EQUALS(*r,"xmm11",4) || EQUALS(*r,"ymm11",4) || EQUALS(*r,"cr11",3) || EQUALS(*r,"dr11",3)) {
-		return 11;
+	if (rex_required) {
+		*code = rex;
 	}
-	else if (EQUALS(*r,"r12l",3) || EQUALS(*r,"r12w",3) || EQUALS(*r,"r12d",3) || EQUALS(*r,"r12",2) 
-	 || EQUALS(*r,"mmx12",4) || EQUALS(*r,"xmm12",4) || EQUALS(*r,"ymm12",4) || EQUALS(*r,"cr12",3) || EQUALS(*r,"dr12",3)) {
-		return 10;
+	return true;
+}
+
+/*
+ * Emits a ModRM byte, along with the SIB byte or displacement that some address registers need
+ * Param mode: DIRECT if rm is an operand, INDIRECT if it holds the address of one
+ * Param reg:  The reg field: a register encoding or an opcode extension
+ * Param rm:   The encoding of the operand or address register
+ */
+void emitModRM(uint8_t mode, uint8_t reg, uint8_t rm) {
+	uint8_t mod_reg_rm = mode | (reg & 7) << 3 | (rm & 7);
+	if (mode == INDIRECT && (rm & 7) == RM_SIB) {
+		// [esp] and [r12] can only be encoded with a SIB byte
+		uint8_t *code = emitCode(2);
+		code[0] = mod_reg_rm;
+		code[1] = SIB_NO_INDEX;
 	}
-	else if (EQUALS(*r,"r13l",3) || EQUALS(*r,"r13w",3) || EQUALS(*r,"r13d",3) || EQUALS(*r,"r13",2) 
-	 || EQUALS(*r,"mmx13",4) || EQUALS(*r,"xmm13",4) || EQUALS(*r,"ymm13",4) || EQUALS(*r,"cr13",3) || EQUALS(*r,"dr13",3)) {
-		return 13;
+	else if (mode == INDIRECT && (rm & 7) == RM_DISP32) {
+		// [ebp] and [r13] can only be encoded with a displacement
+		uint8_t *code = emitCode(2);
+		code[0] = mod_reg_rm | DISP8;
+		code[1] = 0;
 	}
-	else if (EQUALS(*r,"r14l",3) || EQUALS(*r,"r14w",3) || EQUALS(*r,"r14d",3) || EQUALS(*r,"r14",2) 
-	 || EQUALS(*r,"mmx14",4) || EQUALS(*r,"xmm14",4) || EQUALS(*r,"ymm14",4) || EQUALS(*r,"cr14",3) || EQUALS(*r,"dr14",3)) {
-		return 14;
+	else {
+		*emitCode(1) = mod_reg_rm;
 	}
-	else if (EQUALS(*r,"r15l",3) || EQUALS(*r,"r15w",3) || EQUALS(*r,"r15d",3) || EQUALS(*r,"r15",2) 
-	 || EQUALS(*r,"mmx15",4) || EQUALS(*r,"xmm15",4) || EQUALS(*r,"ymm15",4) || EQUALS(*r,"cr15",3) || EQUALS(*r,"dr15",3)) {
-		return 15;
+}
+
+// Emits an immediate of the given width; 64 bit operations take a sign extended 32 bit immediate
+static inline void emitImmediate(int64_t val, int16_t width) {
+	size_t size = width == 64 ? 4 : width / 8;
+	memcpy(emitCode(size), &val, size);
+}
+
+// Finds the general purpose register an operand names, reporting it if there is none
+Register* operandRegister(Token *t) {
+	Register *reg = t->type == TOKEN_IDENTIFIER ? lookupRegister(&t->s) : NULL;
+	if (!reg || reg->class != GENERAL_REG) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid register name: %.*s\n",
+		        infile_name, line_num, (int)t->s.len, t->s.d);
+		return NULL;
 	}
-	else {
-		return INVALID_REGISTER;
+	return reg;
+}
+
+// Reports two register operands of different widths
+bool sameWidth(Register *a, Register *b) {
+	if (a->width != b->width) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Operand sizes do not match: %s, %s\n",
+		        infile_name, line_num, a->name, b->name);
+		return false;
 	}
+	return true;
 }
 
-bool encodeInstruction(char *operands, uint8_t opcode) {
-	String src, dest;
-	getIdentifier(operands, &dest);
-	char *s = dest.d + dest.len;
-	if (*s != ',') {
-		fprintf(stderr, "Assembler Error (%s:%lu): Expected comma\n", infile_name, line_num);
+bool encodeInstruction(Token *operands, uint8_t opcode) {
+	if (!expectToken(operands, TOKEN_IDENTIFIER, "register") || !expectToken(operands+1, TOKEN_COMMA, "comma")) {
+		return false;
+	}
+	Register *dest = operandRegister(operands);
+	if (!dest) {
+		return false;
+	}
+	int16_t width = dest->width;
+	int64_t val;
+	int immediate = immediateOperand(operands+2, &val, width);
+	if (immediate != SUCCESS && immediate != ERROR) {
 		return false;
 	}
-	getIdentifier(s+1, &src);
-	Constant *c = ConstantMapGet(&constants, &src);
 
 	// Immediate or constant source
-	if (c || isdigit(src.d[0])) {
-		ssize_t val;
-		if (c) {
-			val = c->val;
+	if (immediate == SUCCESS) {
+		if (!emitPrefixes(width, NULL, dest, false)) {
+			return false;
 		}
-		else {
-			sscanf(src.d, "%li", &val);
-		}
-		if (EQUALS(dest,"al",2)) {
-			curr_block = makeRoom(2);
-			((uint8_t*)curr_block->data)[curr_block->size] = opcode | AL_I;
-			*((int8_t*)(curr_block->data + curr_block->size + 1)) = (int8_t)val;
-			curr_block->size += 2;
-		}
-		else if (EQUALS(dest,"ax",2)) {
-			curr_block = makeRoom(3);
-			((uint8_t*)curr_block->data)[curr_block->size] = opcode | AX_I;
-			*((int16_t*)(curr_block->data + curr_block->size + 1)) = (int16_t)val;
-			curr_block->size += 3;
-		}
-		else if (EQUALS(dest,"eax",3)) {
-			curr_block = makeRoom(5);
-			((uint8_t*)curr_block->data)[curr_block->size] = opcode | EAX_I;
-			*((int32_t*)(curr_block->data + curr_block->size + 1)) = (int32_t)val;
-			curr_block->size += 5;
+		if (optimize && width > 8 && fitsSignExtendedByte(val, width == 64 ? 32 : width)) {
+			*emitCode(1) = IB_SX;
+			emitModRM(DIRECT, opcode >> 3, dest->encoding);
+			*emitCode(1) = (uint8_t)val;
+			return true;
+		}
+		else if (dest->encoding == 0) {
+			*emitCode(1) = opcode | (width == 8 ? AL_I : EAX_I);
 		}
 		else {
-			int8_t instruction_size;
-			int8_t dest_reg = encodeRegister(&dest);
-			switch(getRegisterWidth(&dest)) {
-				case 8: {
-					curr_block = makeRoom(3);
-					int16_t inst = ((int16_t)(REG_DEST | opcode | dest_reg) << 8) | IB;
-					*((int16_t*)(curr_block->data + curr_block->size)) = inst;
-					*((int8_t*)(curr_block->data + curr_block->size + 2)) = (int8_t)val;
-					curr_block->size += 3;
-					break;
-				}
-				case 16: {
-					curr_block = makeRoom(4);
-					int16_t inst = ((int16_t)(REG_DEST | opcode | dest_reg) << 8) | IW;
-					*((int16_t*)(curr_block->data + curr_block->size)) = inst;
-					*((int16_t*)(curr_block->data + curr_block->size + 2)) = (int16_t)val;
-					curr_block->size += 4;
-					break;
-				}
-				case 32: {
-					curr_block = makeRoom(6);
-					int16_t inst = ((int16_t)(REG_DEST | opcode | dest_reg) << 8) | IL;
-					*((int16_t*)(curr_block->data + curr_block->size)) = inst;
-					*((int32_t*)(curr_block->data + curr_block->size + 2)) = (int32_t)val;
-					curr_block->size += 6;
-					break;
-				}
-				default: {
-					printf("Assembler Error(%s:%lu): Unsupported register width\n",
-					       infile_name, line_num);
-					return false;
-				}
-			}
+			*emitCode(1) = width == 8 ? IB : IL;
+			emitModRM(DIRECT, opcode >> 3, dest->encoding);
 		}
+		emitImmediate(val, width);
 	}
 
 	// Register source
 	else {
-		int8_t encoded_dest = encodeRegister(&dest);
-		int8_t encoded_src = encodeRegister(&src);
-		if (encoded_dest == INVALID_REGISTER) {
-			fprintf(stderr, "Assembler Error (%s:%lu): Invalid register name: %s\n", infile_name, line_num, dest);
-			return SYNTAX_ERROR;
-		}
-		else if (encoded_src == INVALID_REGISTER) {
-			fprintf(stderr, "Assembler Error (%s:%lu): Invalid register name: %s\n", infile_name, line_num, src);
-			return SYNTAX_ERROR;
+		Register *src = operandRegister(operands+2);
+		if (!src || !sameWidth(dest, src) || !emitPrefixes(width, src, dest, false)) {
+			return false;
 		}
-		else if (encoded_dest > 7 || encoded_src > 7) {
-			fprintf(stderr, "Assembler Error (%s:%lu): Extended register set not supported\n", infile_name, line_num);
+		*emitCode(1) = width == 8 ? opcode : opcode | L;
+		emitModRM(DIRECT, src->encoding, dest->encoding);
+	}
+	return true;
+}
+
+
+/*
+ * Checks whether the flags can be clobbered after the current line, by following the code after it
+ * to the next instruction that reads or writes them. Works on the source text, so the answer does not
+ * depend on how the source was split into chunks, and stops at labels, which start every cache region.
+ * Param c: The end of the current line
+ * Returns: true if the flags are overwritten before anything could read them
+ */
+bool flagsDead(char *c) {
+	for (size_t i = 0; i < FLAGS_LOOKAHEAD && *c == '\n'; i++) {
+		c++;
+		while (char_class[(uint8_t)*c] == CHAR_SPACE) c++;
+		if (*c == ';') {
+			while (*c && *c != '\n') c++;
 		}
-		int8_t operands = DIRECT | (encoded_src << 3) | encoded_dest;
-		int16_t width = getRegisterWidth(&dest);
-		curr_block = makeRoom(2);
-		if (width == 8) {
-			((uint8_t*)curr_block->data)[curr_block->size] = opcode;
+		if (*c == '\n') {
+			continue;
 		}
-		else if (width == 16 || width == 32) {
-			((uint8_t*)curr_block->data)[curr_block->size] = opcode | L;
+		String name = {c, 0};
+		while (isIdentifierChar(*c)) c++;
+		name.len = c - name.d;
+		while (char_class[(uint8_t)*c] == CHAR_SPACE) c++;
+		Mnemonic *mnemonic = name.len && *c != ':' ? findMnemonic(&name) : NULL;
+		if (!mnemonic || mnemonic->flags == FLAGS_USED) {
+			return false;
 		}
-		else {
-			fprintf(stderr, "Assembler Error (%s:%lu): Unsupported width: %hi\n", infile_name, line_num, width);
-			return FEATURE_NOT_IMPLEMENTED_YET;
+		else if (mnemonic->flags == FLAGS_WRITTEN) {
+			return true;
 		}
-		((uint8_t*)curr_block->data)[curr_block->size+1] = operands;
-		curr_block->size += 2;
+		while (*c && *c != '\n') c++;
 	}
-	return true;
+	return false;
 }
 
-
-bool moveConstant(size_t value, int16_t width, int8_t encoded_dest) {
-	if (width == 8) {
-		curr_block = makeRoom(2);
-		((uint8_t*)curr_block->data)[curr_block->size] = MOVB_I + encoded_dest;
-		*(int8_t*)(curr_block->data+curr_block->size+1) = value;
-		curr_block->size += 2;
+/*
+ * Encodes a move of an immediate into a register
+ * Param value:    The immediate
+ * Param dest:     The destination register
+ * Param line_end: The end of the instruction's line in the source
+ * Returns:        true if the move was encoded
+ */
+bool moveConstant(int64_t value, Register *dest, char *line_end) {
+	int16_t width = dest->width;
+	bool zero = width == 64 ? value == 0 : (uint32_t)value == 0;
+	if (optimize && width >= 32 && zero && flagsDead(line_end)) {
+		// xor reg, reg: shorter, but clobbers the flags. Writing the 32 bit register clears the upper half.
+		if (!emitPrefixes(32, dest, dest, false)) {
+			return false;
+		}
+		*emitCode(1) = XOR | L;
+		emitModRM(DIRECT, dest->encoding, dest->encoding);
 	}
-	else if (width == 16) {
-		curr_block = makeRoom(3);
-		((uint8_t*)curr_block->data)[curr_block->size] = MOVW_I + encoded_dest;
-		*(int16_t*)(curr_block->data+curr_block->size+1) = value;
-		curr_block->size += 3;
+	else if (optimize && width == 64 && (uint64_t)value <= UINT32_MAX) {
+		// A 32 bit move zero extends into the whole register
+		if (!emitPrefixes(32, NULL, dest, false)) {
+			return false;
+		}
+		*emitCode(1) = MOVL_I + (dest->encoding & 7);
+		emitImmediate(value, 32);
 	}
-	else if (width == 32) {
-		curr_block = makeRoom(5);
-		((uint8_t*)curr_block->data)[curr_block->size] = MOVL_I + encoded_dest;
-		*(int32_t*)(curr_block->data+curr_block->size+1) = value;
-		curr_block->size += 5;
+	else if (optimize && width == 64 && value >= INT32_MIN && value <= INT32_MAX) {
+		if (!emitPrefixes(64, NULL, dest, false)) {
+			return false;
+		}
+		*emitCode(1) = MOVL_RM_I;
+		emitModRM(DIRECT, 0, dest->encoding);
+		emitImmediate(value, 64);
 	}
 	else {
-		fprintf(stderr, "Assembler Error (%s:%lu): Unsupported width: %hi\n", infile_name, line_num, width);
-		return false;
+		if (!emitPrefixes(width, NULL, dest, false)) {
+			return false;
+		}
+		*emitCode(1) = (width == 8 ? MOVB_I : MOVL_I) + (dest->encoding & 7);
+		memcpy(emitCode(width / 8), &value, width / 8);
 	}
 	return true;
 }
 
 
 /*
- * Encodes a move instruction between registers or from register to memory
- * Param curr_block:      The current instruction block being written to
- * Param src:             The name of the src register
- * Param dest:            The name of the destination register
- * Param encoded_dest:    The encoding for the destination register
- * Param addressing_mode: The value for the MOD bits (11 for move, 00 for store)
- * Returns:               true if the move was successfully encoded
+ * Encodes a move between a control register and a general purpose register. The general purpose
+ * register is always the full width of the mode, since the instruction ignores REX.W and operand size.
+ * Param src:  The source register
+ * Param dest: The destination register
+ * Returns:    true if the move was encoded
  */
-bool moveRegister(String *src, String *dest, int8_t encoded_dest, int8_t addressing_mode) {
-
-	int8_t encoded_src = encodeRegister(src);
-	
-	// Invalid instructions
-	if (encoded_dest == INVALID_REGISTER) {
-		fprintf(stderr, "Assembler Error (%s:%lu): Invalid register name: %s\n",
-		        infile_name, line_num, dest->d);
+bool moveControl(Register *src, Register *dest) {
+	bool to_control = dest->class == CONTROL_REG;
+	Register *control = to_control ? dest : src;
+	Register *gpr = to_control ? src : dest;
+	unsigned width = long_mode ? 64 : 32;
+	if (gpr->class != GENERAL_REG || gpr->width != width) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Control registers can only be moved to or from a %u bit register in %u bit mode\n",
+		        infile_name, line_num, width, width);
 		return false;
 	}
-	else if (encoded_src == INVALID_REGISTER) {
-		fprintf(stderr, "Assembler Error (%s:%lu): Invalid register name: %s\n", infile_name,
-		        line_num, src->d);
+	if (!emitPrefixes(0, control, gpr, false)) {
 		return false;
 	}
-	else if (encoded_src > 7) {
-		fprintf(stderr, "Assembler Error (%s:%lu): Extended register set not supported\n",
-		        infile_name, line_num);
-	}
+	uint16_t opcode = to_control ? MOV_CR_R : MOV_R_CR;
+	memcpy(emitCode(2), &opcode, sizeof(opcode));
+	emitModRM(DIRECT, control->encoding, gpr->encoding);
+	return true;
+}
 
-	// To/From control registers
-	if (!strncmp(src->d, "cr", 2)) {
-		curr_block = makeRoom(3);
-		uint16_t *d = curr_block->data + curr_block->size;
-		*d = MOV_R_CR;
-		*(uint8_t*)(d+1) = DIRECT | (encoded_src << 3) | encoded_dest;
-		curr_block->size += 3;
-	}
-	else if (!strncmp(dest->d, "cr", 2)) {
-		curr_block = makeRoom(3);
-		uint16_t *d = curr_block->data + curr_block->size;
-		*d = MOV_CR_R;
-		*(uint8_t*)(d+1) = DIRECT | (encoded_dest << 3) | encoded_src;
-		curr_block->size += 3;
+
+/*
+ * Encodes a jump or jump conditional instruction. Forward jumps become fragments for relaxation.
+ * Code between a label and a backward jump to it can only grow, so a backward jump with no fragments
+ * in between is encoded right away, and one that is already out of short range starts out near.
+ * Param dest:   The destination for the jump
+ * Param opcode: The instruction opcode
+ * Returns:      SUCCESS
+*/
+int encodeJump(Token *dest, uint16_t opcode) {
+	if (!expectToken(dest, TOKEN_IDENTIFIER, "label")) {
+		return SYNTAX_ERROR;
 	}
 
-	// Regular registers
-	else {
-		curr_block = makeRoom(2);
-		int16_t width = getRegisterWidth(dest);
-		if (width == 8) {
-			((uint8_t*)curr_block->data)[curr_block->size] = MOVB;
+	Program *p = &program;
+	uint32_t target = labelId(dest->symbol);
+	if (p->label_offset[target] != UNDEFINED_LABEL) {
+		size_t distance = p->code_len - p->label_offset[target];
+		if (distance + SHORT_JUMP_SIZE > -INT8_MIN) {
+			opcode = nearJump(opcode);
+			STAT_ADD(jumps_near, 1);
 		}
-		else if (width == 16 || width == 32) {
-			((uint8_t*)curr_block->data)[curr_block->size] = MOVL;
+		if (p->label_fragment[target] == p->num_frags) {
+			size_t size = fragmentSize(opcode);
+			writeJump(emitCode(size), opcode, -(int64_t)(distance + size));
+			STAT_ADD(jumps_resolved, 1);
+			return SUCCESS;
 		}
-		else {
-			fprintf(stderr, "Assembler Error (%s:%lu): Unsupported width: %hi\n", infile_name,
-			        line_num, width);
-			return false;
+	}
+	addFragment(FRAGMENT_JUMP, opcode, target);
+	return SUCCESS;
+}
+
+
+/*
+ * Handles an align directive, padding to the next multiple of the alignment with NOPs or a fill byte
+ * Param operands: The alignment, optionally followed by a comma and the fill byte
+ * Returns:        SUCCESS or an error code
+ */
+int encodeAlign(Token *operands, uint16_t unused) {
+	int64_t align;
+	int status = immediateValue(operands, &align, 64);
+	if (status == ERROR) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Directive \"align\" requires an argument\n", infile_name, line_num);
+		return SYNTAX_ERROR;
+	}
+	else if (status != SUCCESS) {
+		return status;
+	}
+	if (align < 1 || align > MAX_ALIGN || (align & (align - 1))) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Alignment must be a power of two up to %u\n",
+		        infile_name, line_num, MAX_ALIGN);
+		return SEMANTIC_ERROR;
+	}
+	uint32_t fill = ALIGN_NOP;
+	if (operands[1].type == TOKEN_COMMA) {
+		int64_t val;
+		status = immediateValue(operands + 2, &val, 8);
+		if (status == ERROR) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Expected fill byte\n", infile_name, line_num);
+			return SYNTAX_ERROR;
 		}
-		if (addressing_mode == INDIRECT) {
-			int8_t tmp = encoded_src;
-			encoded_src = encoded_dest;
-			encoded_dest = tmp;
+		else if (status != SUCCESS) {
+			return status;
 		}
-		int8_t mod_reg_rm = addressing_mode | (encoded_dest << 3) | encoded_src;
-		((uint8_t*)curr_block->data)[curr_block->size+1] = mod_reg_rm;
-		curr_block->size += 2;
+		fill = (uint8_t)val;
 	}
-	return true;
+	addFragment(FRAGMENT_ALIGN, align, fill);
+	return SUCCESS;
 }
 
 
+char *data_directives[] = {NULL, "db", "dw", NULL, "dd", NULL, NULL, NULL, "dq"};
+
 /*
- * Encodes a jump or jump conditional instruction
- * Param curr_block: The current instruction block being written to
- * Param dest:       The destination for the jump
- * Param opcode:     The instruction opcode
- * Returns:          The new block to write to
-*/
-Block* encodeJump(char *dest, uint8_t opcode) {
-	if (curr_block->capacity) {
-		Block *new_block = malloc(sizeof(Block));
-		new_block->next = NULL;
-		new_block->address = curr_block->address + curr_block->size;
-		curr_block->next = new_block;
-		curr_block = new_block;
+ * Encodes a db, dw, dd or dq directive
+ * Param operands: The tokens following the directive
+ * Param width:    The number of bytes to define
+ * Returns:        SUCCESS or an error code
+ */
+int encodeData(Token *operands, uint16_t width) {
+	uint8_t *code = emitCode(width);
+	int64_t val;
+	int status = immediateValue(operands, &val, width * 8);
+	if (status == ERROR) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Directive \"%s\" requires an argument\n",
+		        infile_name, line_num, data_directives[width]);
+		return SYNTAX_ERROR;
 	}
-
-	curr_block->size = 2;
-	curr_block->opcode = opcode;
-	curr_block->line_num = line_num;
-	curr_block->long_mode = long_mode;
-	
-	String target;
-	getIdentifier(dest, &target);
-	curr_block->capacity = target.len;
-	curr_block->data = malloc(target.len);
-	memcpy(curr_block->data, target.d, target.len);
-	return curr_block;
+	else if (status != SUCCESS) {
+		return status;
+	}
+	memcpy(code, &val, width);
+	return SUCCESS;
 }
 
 
-int main(int argc, char **argv) {
-	char *outfile_name = NULL;
-	bool o_flag = false;
-	for (size_t i = 1; i < argc; i++) {
-		if (o_flag) {
-			outfile_name = argv[i];
-			o_flag = false;
+// Operand size keywords, indexed by the width in bytes
+char *size_keywords[] = {NULL, "BYTE", "WORD", NULL, "DWORD", NULL, NULL, NULL, "QWORD"};
+
+// Finds the operand width a size keyword such as DWORD gives, or 0 if t is not one
+int16_t sizeKeyword(Token *t) {
+	for (int16_t i = 1; t->type == TOKEN_IDENTIFIER && i <= 8; i <<= 1) {
+		if (EQUALS(t->s, size_keywords[i], strlen(size_keywords[i]))) {
+			return i * 8;
 		}
-		else if (argv[i][0] == '-') {
-			for (char *j = argv[i] + 1; *j; j++) {
-				if (*j == 'o') {
-					o_flag = true;
-				}
-			}
+	}
+	return 0;
+}
+
+int encodeMove(Token *t, uint16_t unused) {
+	int16_t size = sizeKeyword(t);
+	if (size) {
+		t++;
+	}
+	bool store = t->type == TOKEN_LBRACKET;
+	Register *dest;
+	if (store) {
+		if (t[1].type != TOKEN_IDENTIFIER || t[2].type != TOKEN_RBRACKET) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid Address Format\n",
+			        infile_name, line_num);
+			return SYNTAX_ERROR;
 		}
-		else {
-			infile_name = argv[i];
+		dest = operandRegister(t + 1);
+		t += 3;
+	}
+	else if (size) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid Address Format\n",
+		        infile_name, line_num);
+		return SYNTAX_ERROR;
+	}
+	else {
+		if (!expectToken(t, TOKEN_IDENTIFIER, "register")) {
+			return SYNTAX_ERROR;
 		}
+		dest = lookupRegister(&t->s);
+		if (!dest || (dest->class != GENERAL_REG && dest->class != CONTROL_REG)) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid register name: %.*s\n",
+			        infile_name, line_num, (int)t->s.len, t->s.d);
+			return SYNTAX_ERROR;
+		}
+		t++;
 	}
-	if (!infile_name) {
-		fprintf(stderr, "Assembler Error: No input file\n");
-		return USAGE_ERROR;
+	if (!dest) {
+		return SYNTAX_ERROR;
 	}
-	FILE *infile = fopen(infile_name, "r");
-	if (!infile) {
-		fprintf(stderr, "Assembler Error (%s:1): cannot open file for reading\n", infile_name);
-		return IO_ERROR;
+	if (!expectToken(t, TOKEN_COMMA, "comma")) {
+		return SYNTAX_ERROR;
 	}
+	t++;
+	int16_t width = store ? (size ? size : 32) : dest->width;
+	int64_t value;
+	int status = store ? immediateOperand(t, &value, width)
+	                   : immediateValue(t, &value, dest->class == CONTROL_REG ? 0 : width);
+	if (status != SUCCESS && status != ERROR) {
+		return status;
+	}
+	bool immediate = status == SUCCESS;
+	if (store) {
 
-	Block *text_segment = calloc(1, sizeof(Block));
-	curr_block = text_segment;
-
-	LabelMap labels;
-	LabelMapInit(&labels);
-	ConstantMapInit(&constants);
-
-	char *buffer = NULL;
-	size_t buffer_size = 0;
-
-	ssize_t n;
-	while ((n = getline(&buffer, &buffer_size, infile)) >= 1) {
-
-		line_num++;
-		String opcode;
-		size_t offset = getIdentifier(buffer, &opcode);
-		char *operands = opcode.d + opcode.len;
-
-		// db
-		if (EQUALS(opcode,"db",2)) {
-			curr_block = makeRoom(1);
-			String value;
-			getIdentifier(operands, &value);
-			Constant *c = ConstantMapGet(&constants, &value);
-			uint8_t *target = curr_block->data + curr_block->size;
-			if (c) {
-				*target = c->val;
-			}
-			else if (sscanf(operands, " %hhi", target) != 1) {
-				fprintf(stderr,
-				        "Assembler Error (%s:%lu): Directive \"db\" requires an argument\n",
-						infile_name, line_num);
-				return SYNTAX_ERROR;
-			}
-			curr_block->size += 1;
-		}
-
-		// dw
-		else if (EQUALS(opcode,"dw",2)) {
-			curr_block = makeRoom(2);
-			String value;
-			getIdentifier(operands, &value);
-			Constant *c = ConstantMapGet(&constants, &value);
-			uint16_t *target = curr_block->data + curr_block->size;
-			if (c) {
-				*target = c->val;
-			}
-			else if (sscanf(operands, " %hi", target) != 1) {
-				fprintf(stderr, "Assembler Error (%s:%lu): Directive \"dw\" requires an argument\n", infile_name, line_num);
-				return SYNTAX_ERROR;
-			}
-			curr_block->size += 2;
-		}
-
-		// dd
-		else if (EQUALS(opcode,"dd",2)) {
-			curr_block = makeRoom(4);
-			String value;
-			getIdentifier(operands, &value);
-			Constant *c = ConstantMapGet(&constants, &value);
-			uint32_t *target = curr_block->data + curr_block->size;
-			if (c) {
-				*target = c->val;
-			}
-			else if (sscanf(operands, " %i", target) != 1) {
-				fprintf(stderr, "Assembler Error (%s:%lu): Directive \"dd\" requires an argument\n", infile_name, line_num);
-				return SYNTAX_ERROR;
-			}
-			curr_block->size += 4;
-		}
-
-		// dq
-		else if (EQUALS(opcode,"dq",2)) {
-			curr_block = makeRoom(8);
-			String value;
-			getIdentifier(operands, &value);
-			Constant *c = ConstantMapGet(&constants, &value);
-			uint8_t *target = curr_block->data + curr_block->size;
-			if (c) {
-				*target = c->val;
+		// Store from immediate
+		if (immediate) {
+			if (!emitPrefixes(width, NULL, dest, true)) {
+				return SEMANTIC_ERROR;
 			}
-			else if (sscanf(operands, " %lli", target) != 1) {
-				fprintf(stderr,
-				        "Assembler Error (%s:%lu): Directive \"dq\" requires an argument\n",
-						infile_name, line_num);
+			*emitCode(1) = width == 8 ? STB_I : STL_I;
+			emitModRM(INDIRECT, 0, dest->encoding);
+			emitImmediate(value, width);
+		}
+
+		// Store from register
+		else {
+			Register *src = operandRegister(t);
+			if (!src) {
 				return SYNTAX_ERROR;
 			}
-			curr_block->size += 8;
-		}
-
-		// jmp
-		else if (EQUALS(opcode,"jmp",3)) {
-			curr_block = encodeJump(operands, SHORT_JMP);
-		}
-
-		// jnz
-		else if (EQUALS(opcode,"jnz",3)) {
-			curr_block = encodeJump(operands, SHORT_JNZ);
-		}
-
-		// mov
-		else if (EQUALS(opcode,"mov",3)) {
-			String src, dest;
-			getIdentifier(operands, &dest);
-			int16_t width;
-			bool storeImmediate = EQUALS(dest,"DWORD",5);
-			bool store = storeImmediate || *(dest.d) == '[';
-			int8_t encoded_dest;
-			char *s = dest.d + dest.len;
-			if (store) {
-				width = 32;
-				while (isspace(*s)) s++;
-				if (*s != '[') {
-					fprintf(stderr, "Assembler Error (%s:%lu): Invalid Address Format\n",
-					        infile_name, line_num);
-					return SYNTAX_ERROR;
-				}
-				s++;
-				s += getIdentifier(s, &dest);
-				s += dest.len;
-				encoded_dest = encodeRegister(&dest);
-				while (isspace(*s)) s++;
-				if (*s != ']') {
-					fprintf(stderr, "Assembler Error (%s,%lu): Invalid Address Format\n", infile_name, line_num);
-					return SYNTAX_ERROR;
-				}
-				s++;
-			}
-			else {
-				width = getRegisterWidth(&dest);
-				encoded_dest = encodeRegister(&dest);
-			}
-			if (*s != ',') {
-				fprintf(stderr, "Assembler Error (%s:%lu): Expected comma\n", infile_name, line_num);
-				return SYNTAX_ERROR;
+			if (size && size != src->width) {
+				fprintf(diagnostics, "Assembler Error (%s:%lu): Operand sizes do not match: %s\n",
+				        infile_name, line_num, src->name);
+				return SEMANTIC_ERROR;
 			}
-			getIdentifier(s+1, &src);
-			Constant *v = ConstantMapGet(&constants, &src);
-			if (encoded_dest > 7) {
-				fprintf(stderr, "Assembler Error (%s:%lu): Extended register set not supported\n",
-				        infile_name, line_num);
-				return FEATURE_NOT_IMPLEMENTED_YET;
+			if (!emitPrefixes(src->width, src, dest, true)) {
+				return SEMANTIC_ERROR;
 			}
-			else if (store) {
-
-				// Store from constant
-				if (v) {
-					switch (width) {
-						case 8: {
-							curr_block = makeRoom(3);
-							uint16_t inst = ((int16_t)encoded_dest << 8) | STB_I;
-							*(uint16_t*)(curr_block->data+curr_block->size) = inst;
-							*(int8_t*)(curr_block->data+curr_block->size+2) = (int8_t)(v->val);
-							curr_block->size += 3;
-							break;
-						}
-						case 16: {
-							curr_block = makeRoom(4);
-							uint16_t inst = ((int16_t)encoded_dest << 8) | STW_I;
-							*(uint16_t*)(curr_block->data+curr_block->size) = inst;
-							*(int16_t*)(curr_block->data+curr_block->size+2) = (int16_t)(v->val);
-							curr_block->size += 4;
-							break;
-						}
-						case 32: {
-							curr_block = makeRoom(6);
-							uint16_t inst = ((int16_t)encoded_dest << 8) | STL_I;
-							*(uint16_t*)(curr_block->data+curr_block->size) = inst;
-							*(int32_t*)(curr_block->data+curr_block->size+2) = (int32_t)(v->val);
-							curr_block->size += 6;
-							break;
-						}
-						default: {
-							fprintf(stderr, "Assembler Error (%s:%lu): Unsupported width: %hi\n",
-									infile_name, line_num, width);
-							return false;
-						}
-					}
-				}
-				else if (storeImmediate){
-					fprintf(stderr,
-					        "Assembler Error (%s:%lu): Storing from immediate not supported\n",
-							infile_name, line_num);
-					return FEATURE_NOT_IMPLEMENTED_YET;
-				}
+			*emitCode(1) = src->width == 8 ? MOVB_M_R : MOVL_M_R;
+			emitModRM(INDIRECT, src->encoding, dest->encoding);
+		}
+	}
 
-				// Store from register
-				else {
-					if (!moveRegister(&src, &dest, encoded_dest, INDIRECT)) {
-						return SYNTAX_ERROR;
-					}
-				}
-			}
+	// Move from immediate (constant or literal)
+	else if (immediate) {
+		if (dest->class == CONTROL_REG) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Control registers can only be moved to or from a 32 or 64 bit register\n",
+			        infile_name, line_num);
+			return SEMANTIC_ERROR;
+		}
+		Token *line_end = t;
+		while (line_end->type != TOKEN_NEWLINE && line_end->type != TOKEN_END) line_end++;
+		if (!moveConstant(value, dest, line_end->s.d)) {
+			return SEMANTIC_ERROR;
+		}
+	}
 
-			// Move from immediate (constant)
-			else if (v) {
-				if (!moveConstant(v->val, width, encoded_dest)) {
-					return FEATURE_NOT_IMPLEMENTED_YET;
-				}
-			}
+	// Move from register
+	else {
+		Register *src = lookupRegister(&t->s);
+		if (!src || t->type != TOKEN_IDENTIFIER || (src->class != GENERAL_REG && src->class != CONTROL_REG)) {
+			fprintf(diagnostics, "Assembler Error (%s:%lu): Invalid register name: %.*s\n",
+			        infile_name, line_num, (int)t->s.len, t->s.d);
+			return SYNTAX_ERROR;
+		}
+		if (src->class == CONTROL_REG || dest->class == CONTROL_REG) {
+			return moveControl(src, dest) ? SUCCESS : SEMANTIC_ERROR;
+		}
+		if (!sameWidth(dest, src) || !emitPrefixes(width, src, dest, false)) {
+			return SEMANTIC_ERROR;
+		}
+		*emitCode(1) = width == 8 ? MOVB : MOVL;
+		emitModRM(DIRECT, src->encoding, dest->encoding);
+	}
+	return SUCCESS;
+}
 
-			// Move from immediate (literal)
-			else if (isdigit(src.d[0])) {
-				if (width == 8) {
-					curr_block = makeRoom(2);
-					((uint8_t*)curr_block->data)[curr_block->size] = MOVB_I + encoded_dest;
-					sscanf(src.d, "%hhi", (int8_t*)(curr_block->data+curr_block->size+1));
-					curr_block->size += 2;
-				}
-				else if (width == 16) {
-					curr_block = makeRoom(3);
-					((uint8_t*)curr_block->data)[curr_block->size] = MOVW_I + encoded_dest;
-					sscanf(src.d, "%hi", (int16_t*)(curr_block->data+curr_block->size+1));
-					curr_block->size += 3;
-				}
-				else if (width == 32) {
-					curr_block = makeRoom(5);
-					((uint8_t*)curr_block->data)[curr_block->size] = MOVL_I + encoded_dest;
-					sscanf(src.d, "%i", (int32_t*)(curr_block->data+curr_block->size+1));
-					curr_block->size += 5;
-				}
-				else {
-					fprintf(stderr, "Assembler Error (%s:%lu): Unsupported width: %hi\n", infile_name, line_num, width);
-					return FEATURE_NOT_IMPLEMENTED_YET;
-				}
-			}
 
-			// Move from register
-			else {
-				if (!moveRegister(&src, &dest, encoded_dest, DIRECT)) {
-					return SYNTAX_ERROR;
-				}
+int encodeArithmetic(Token *operands, uint16_t opcode) {
+	return encodeInstruction(operands, opcode) ? SUCCESS : ERROR;
+}
+
+
+int encodeDecrement(Token *operands, uint16_t unused) {
+	Register *reg = operandRegister(operands);
+	if (!reg) {
+		return SYNTAX_ERROR;
+	}
+	if (!emitPrefixes(reg->width, NULL, reg, false)) {
+		return SEMANTIC_ERROR;
+	}
+	if (long_mode || reg->width == 8) {
+		// 48+r is a REX prefix in 64 bit mode
+		*emitCode(1) = reg->width == 8 ? DECB_RM : DECL_RM;
+		emitModRM(DIRECT, DEC_EXTENSION, reg->encoding);
+	}
+	else {
+		*emitCode(1) = DEC | reg->encoding;
+	}
+	return SUCCESS;
+}
+
+
+// The string instructions rep can repeat
+StringInstruction string_instructions[] = {
+	{"stosb", STOSB, 8}, {"stosw", STOSL, 16}, {"stosd", STOSL, 32}, {"stosq", STOSL, 64},
+	{"movsb", MOVSB, 8}, {"movsw", MOVSL, 16}, {"movsd", MOVSL, 32}, {"movsq", MOVSL, 64},
+};
+
+#define NUM_STRING_INSTRUCTIONS (sizeof(string_instructions) / sizeof(StringInstruction))
+
+int encodeRepeat(Token *operands, uint16_t unused) {
+	String command = operands->s;
+	for (size_t i = 0; i < NUM_STRING_INSTRUCTIONS; i++) {
+		StringInstruction *s = string_instructions + i;
+		if (operands->type == TOKEN_IDENTIFIER && EQUALS(command, s->name, 5)) {
+			*emitCode(1) = REP;
+			if (!emitPrefixes(s->width, NULL, NULL, false)) {
+				return SEMANTIC_ERROR;
 			}
+			*emitCode(1) = s->opcode;
+			return SUCCESS;
 		}
+	}
+	fprintf(diagnostics, "Assembler Error (%s:%lu): Unsuported instruction: rep ", infile_name, line_num);
+	fwrite((void*)command.d, sizeof(char), command.len, diagnostics);
+	fputc('\n', diagnostics);
+	return FEATURE_NOT_IMPLEMENTED_YET;
+}
 
-		else if (EQUALS(opcode,"and",3)) {
-			if (!encodeInstruction(operands, AND)) {
-				return ERROR;
-			}
+
+// Encodes an instruction with a fixed two byte encoding
+int encodeFixed(Token *operands, uint16_t encoding) {
+	memcpy(emitCode(2), &encoding, sizeof(encoding));
+	return SUCCESS;
+}
+
+
+// Every mnemonic and directive the assembler recognizes.
+// New entries only need a line here; the dispatch table is built from this list at startup.
+Mnemonic mnemonics[] = {
+	{"db",    encodeData,       1,         FLAGS_USED},
+	{"dw",    encodeData,       2,         FLAGS_USED},
+	{"dd",    encodeData,       4,         FLAGS_USED},
+	{"dq",    encodeData,       8,         FLAGS_USED},
+	{"jmp",   encodeJump,       SHORT_JMP, FLAGS_USED},
+	{"jnz",   encodeJump,       SHORT_JNZ, FLAGS_USED},
+	{"mov",   encodeMove,       0,         FLAGS_KEPT},
+	{"and",   encodeArithmetic, AND,       FLAGS_WRITTEN},
+	{"add",   encodeArithmetic, ADD,       FLAGS_WRITTEN},
+	{"xor",   encodeArithmetic, XOR,       FLAGS_WRITTEN},
+	{"or",    encodeArithmetic, OR,        FLAGS_WRITTEN},
+	{"dec",   encodeDecrement,  0,         FLAGS_WRITTEN},
+	{"rep",   encodeRepeat,     0,         FLAGS_KEPT},
+	{"rdmsr", encodeFixed,      RDMSR,     FLAGS_KEPT},
+	{"wrmsr", encodeFixed,      WRMSR,     FLAGS_KEPT},
+	{"align", encodeAlign,      0,         FLAGS_USED},
+};
+
+#define NUM_MNEMONICS (sizeof(mnemonics) / sizeof(Mnemonic))
+
+PerfectHash mnemonic_table;
+
+bool buildMnemonicTable() {
+	uint64_t keys[NUM_MNEMONICS];
+	for (size_t i = 0; i < NUM_MNEMONICS; i++) {
+		keys[i] = packKey(mnemonics[i].name, strlen(mnemonics[i].name));
+	}
+	return perfectHashBuild(&mnemonic_table, keys, NUM_MNEMONICS);
+}
+
+/*
+ * Finds the mnemonic or directive named by an identifier
+ * Param opcode: The identifier at the start of a line
+ * Returns:      The matching table entry, or NULL for labels and constants
+ */
+Mnemonic* findMnemonic(String *opcode) {
+	int32_t i = perfectHashFind(&mnemonic_table, packKey(opcode->d, opcode->len));
+	return i < 0 ? NULL : mnemonics + i;
+}
+
+
+// Fenwick tree over the growth of each fragment, so the address shift before any fragment is a prefix sum
+typedef struct GrowthTree {
+	size_t *d;
+	size_t  len;
+} GrowthTree;
+
+void growthAdd(GrowthTree *t, size_t i, size_t delta) {
+	for (i++; i <= t->len; i += i & -i) {
+		t->d[i] += delta;
+	}
+}
+
+// Total growth of fragments [0, i)
+size_t growthBefore(GrowthTree *t, size_t i) {
+	size_t ret = 0;
+	for (; i; i -= i & -i) {
+		ret += t->d[i];
+	}
+	return ret;
+}
+
+// Address of fragment i: every fragment counts as a short jump plus its growth
+static inline size_t jumpAddress(Program *p, GrowthTree *growth, size_t i) {
+	return p->frag_offset[i] + i * SHORT_JUMP_SIZE + growthBefore(growth, i);
+}
+
+static inline int64_t jumpDisplacement(Program *p, GrowthTree *growth, size_t i) {
+	uint32_t target = p->frag_target[i];
+	size_t k = p->label_fragment[target];
+	size_t target_address = p->label_offset[target] + k * SHORT_JUMP_SIZE + growthBefore(growth, k);
+	return (int64_t)target_address - (int64_t)jumpAddress(p, growth, i) - fragmentSize(p->frag_opcode[i]);
+}
+
+/*
+ * Checks that every jump target was defined
+ * Returns: SUCCESS, or SEMANTIC_ERROR if a jump targets an unknown label
+ */
+int resolveLabels(Program *p) {
+	for (size_t i = 0; i < p->num_frags; i++) {
+		uint32_t target = p->frag_target[i];
+		if (p->frag_kind[i] == FRAGMENT_JUMP && p->label_offset[target] == UNDEFINED_LABEL) {
+			fprintf(diagnostics, "Assembler Error(%s:%u): unknown label \"", infile_name, p->frag_line[i]);
+			String *name = symbols.names + p->label_symbol[target];
+			fwrite(name->d, sizeof(char), name->len, diagnostics);
+			fputs("\"\n", diagnostics);
+			return SEMANTIC_ERROR;
 		}
+	}
+	return SUCCESS;
+}
+
+static inline size_t labelAddress(Program *p, uint32_t id) {
+	return p->label_offset[id] + p->frag_shift[p->label_fragment[id]];
+}
+
+static inline size_t fragmentAddress(Program *p, size_t i) {
+	return p->frag_offset[i] + p->frag_shift[i];
+}
 
-		else if (EQUALS(opcode,"add",3)) {
-			if (!encodeInstruction(operands, ADD)) {
-				return ERROR;
+// Bytes of padding an alignment fragment at address needs
+static inline size_t alignPadding(Program *p, size_t i, size_t address) {
+	return -address & (p->frag_opcode[i] - 1);
+}
+
+/*
+ * Relaxes the jumps of a program that contains alignments, in passes over the whole program
+ * Param p: The parsed program, with every label resolved; p->frag_shift is filled in
+ *
+ * Growth before an alignment can move everything after it by up to the alignment, so a widened jump
+ * can push any later jump out of range. Each pass lays out the program with the current jump sizes
+ * and widens every short jump that does not reach; jumps still only grow, and every address only
+ * moves forward as they do, so the passes end once a layout needs no more widening.
+ *
+ * Padding can also shrink as code before it grows, so a backward jump that parsing started out near
+ * may reach short in the final layout. Every jump starts short here instead, so the result does not
+ * depend on which labels parsing had seen, and serial, parallel and cached runs agree.
+ */
+void relaxAligned(Program *p) {
+	size_t num_frags = p->num_frags;
+	for (size_t i = 0; i < num_frags; i++) {
+		if (p->frag_kind[i] == FRAGMENT_JUMP) {
+			p->frag_opcode[i] = shortJump(p->frag_opcode[i]);
+		}
+	}
+	p->frag_shift = malloc((num_frags + 1) * sizeof(uint32_t));
+	for (bool widened = true; widened;) {
+		widened = false;
+		p->frag_shift[0] = 0;
+		for (size_t i = 0; i < num_frags; i++) {
+			size_t size = p->frag_kind[i] == FRAGMENT_ALIGN ? alignPadding(p, i, fragmentAddress(p, i))
+			                                               : fragmentSize(p->frag_opcode[i]);
+			p->frag_shift[i+1] = p->frag_shift[i] + size;
+		}
+		for (size_t i = 0; i < num_frags; i++) {
+			uint16_t opcode = p->frag_opcode[i];
+			if (p->frag_kind[i] != FRAGMENT_JUMP || (opcode != SHORT_JMP && opcode != SHORT_JNZ)) {
+				continue;
+			}
+			STAT_ADD(relax_visits, 1);
+			int64_t displacement = (int64_t)labelAddress(p, p->frag_target[i]) - (int64_t)fragmentAddress(p, i)
+			                     - SHORT_JUMP_SIZE;
+			if (displacement < INT8_MIN || displacement > INT8_MAX) {
+				p->frag_opcode[i] = nearJump(opcode);
+				STAT_ADD(relax_widened, 1);
+				widened = true;
 			}
 		}
+	}
+}
+
+/*
+ * Chooses the shortest encoding for every jump and computes the final layout
+ * Param p: The parsed program, with every label resolved; p->frag_shift is filled in
+ *
+ * Every jump starts short, except backward jumps already known to be near while parsing. Widening
+ * a jump can only push other displacements further out of range, so jumps only ever grow and the
+ * process converges on the minimal encoding. A widened jump only affects short jumps whose span
+ * contains it, and short jumps span at most 128 bytes, so only jumps near the widened one go back
+ * on the worklist.
+ */
+void relaxJumps(Program *p) {
+	size_t num_frags = p->num_frags;
+	for (size_t i = 0; i < num_frags; i++) {
+		if (p->frag_kind[i] == FRAGMENT_ALIGN) {
+			relaxAligned(p);
+			return;
+		}
+	}
+	bool *queued = malloc(num_frags + 1);
+	size_t *worklist = malloc((num_frags + 1) * sizeof(size_t));
+	GrowthTree growth;
+	growth.len = num_frags;
+	growth.d = calloc(num_frags + 1, sizeof(size_t));
+
+	// Worklist is a stack; each jump is on it at most once. Jumps that were near from the start never
+	// need another look, but their growth counts from the start.
+	size_t pending = 0;
+	for (size_t i = num_frags; i-- > 0;) {
+		uint16_t opcode = p->frag_opcode[i];
+		queued[i] = opcode == SHORT_JMP || opcode == SHORT_JNZ;
+		if (queued[i]) {
+			worklist[pending++] = i;
+		}
+		else {
+			growthAdd(&growth, i, fragmentSize(opcode) - SHORT_JUMP_SIZE);
+		}
+	}
+	while (pending) {
+		size_t i = worklist[--pending];
+		queued[i] = false;
+		STAT_ADD(relax_visits, 1);
+		uint16_t opcode = p->frag_opcode[i];
+		if (opcode != SHORT_JMP && opcode != SHORT_JNZ) {
+			continue;
+		}
+		int64_t displacement = jumpDisplacement(p, &growth, i);
+		if (displacement >= INT8_MIN && displacement <= INT8_MAX) {
+			continue;
+		}
 
-		else if (EQUALS(opcode,"xor",3)) {
-			if (!encodeInstruction(operands, XOR)) {
-				return ERROR;
+		p->frag_opcode[i] = nearJump(opcode);
+		STAT_ADD(relax_widened, 1);
+		growthAdd(&growth, i, fragmentSize(p->frag_opcode[i]) - SHORT_JUMP_SIZE);
+
+		// Requeue short jumps close enough that their span might contain this one
+		size_t address = jumpAddress(p, &growth, i);
+		for (size_t j = i; j-- > 0;) {
+			if (address - jumpAddress(p, &growth, j) > SHORT_JUMP_REACH) {
+				break;
+			}
+			if (!queued[j] && p->label_fragment[p->frag_target[j]] > i) {
+				queued[j] = true;
+				worklist[pending++] = j;
+			}
+		}
+		for (size_t j = i + 1; j < num_frags; j++) {
+			if (jumpAddress(p, &growth, j) - address > SHORT_JUMP_REACH) {
+				break;
+			}
+			if (!queued[j] && p->label_fragment[p->frag_target[j]] <= i) {
+				queued[j] = true;
+				worklist[pending++] = j;
 			}
 		}
+	}
+
+	// frag_shift[i] is the number of fragment bytes before fragment i
+	p->frag_shift = malloc((num_frags + 1) * sizeof(uint32_t));
+	p->frag_shift[0] = 0;
+	for (size_t i = 0; i < num_frags; i++) {
+		p->frag_shift[i+1] = p->frag_shift[i] + fragmentSize(p->frag_opcode[i]);
+	}
+
+	free(queued);
+	free(worklist);
+	free(growth.d);
+}
+
+// Recommended NOP sequences of each length
+uint8_t nops[MAX_NOP_SIZE + 1][MAX_NOP_SIZE] = {
+	{},
+	{0x90},
+	{0x66, 0x90},
+	{0x0F, 0x1F, 0x00},
+	{0x0F, 0x1F, 0x40, 0x00},
+	{0x0F, 0x1F, 0x44, 0x00, 0x00},
+	{0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+	{0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+	{0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+	{0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+// Writes size bytes of padding as the fewest NOP instructions, or as copies of a fill byte
+void emitPadding(uint8_t *out, size_t size, uint32_t fill) {
+	if (fill != ALIGN_NOP) {
+		memset(out, fill, size);
+		return;
+	}
+	while (size) {
+		size_t len = size < MAX_NOP_SIZE ? size : MAX_NOP_SIZE;
+		memcpy(out, nops[len], len);
+		out += len;
+		size -= len;
+	}
+}
 
-		else if (EQUALS(opcode,"or",2)) {
-			if (!encodeInstruction(operands, OR)) {
-				return ERROR;
+/*
+ * Writes the final code of a relaxed program, inserting each jump and padding at its offset
+ * Param p:   The program
+ * Param out: Where to write; must hold code_len + frag_shift[num_frags] bytes
+ */
+void emitProgram(Program *p, uint8_t *out) {
+	size_t written = 0;
+	for (size_t i = 0; i < p->num_frags; i++) {
+		size_t len = p->frag_offset[i] - written;
+		memcpy(out, p->code + written, len);
+		out += len;
+		written = p->frag_offset[i];
+		uint16_t opcode = p->frag_opcode[i];
+		size_t size = p->frag_shift[i+1] - p->frag_shift[i];
+		if (p->frag_kind[i] == FRAGMENT_ALIGN) {
+			emitPadding(out, size, p->frag_target[i]);
+			out += size;
+			continue;
+		}
+		writeJump(out, opcode, labelAddress(p, p->frag_target[i]) - fragmentAddress(p, i) - size);
+		out += size;
+	}
+	memcpy(out, p->code + written, p->code_len - written);
+}
+
+#define LISTING_BYTES 8		// Bytes shown on each row of the listing
+
+static inline size_t lineAddress(Program *p, size_t i) {
+	return p->line_offset[i] + p->frag_shift[p->line_fragment[i]];
+}
+
+// Prints up to LISTING_BYTES bytes of code in hex, padded to the width of a full row
+void printListingBytes(FILE *f, uint8_t *code, size_t len) {
+	size_t n = len < LISTING_BYTES ? len : LISTING_BYTES;
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "%02X", code[i]);
+	}
+	fprintf(f, "%*s", (int)(2 * (LISTING_BYTES - n)), "");
+}
+
+/*
+ * Writes the listing: every source line, with the address and bytes of the code it assembled to
+ * Param f:      Where to write the listing
+ * Param p:      The relaxed program, with line records
+ * Param source: The source text
+ * Param code:   The emitted code
+ * Param len:    The size of the emitted code
+ */
+void writeListing(FILE *f, Program *p, Source *source, uint8_t *code, size_t len) {
+	char *line = source->d;
+	char *end = source->d + source->len;
+	size_t record = 0;
+	for (size_t n = 1; line < end; n++) {
+		char *eol = memchr(line, '\n', end - line);
+		if (!eol) {
+			eol = end;
+		}
+		if (record < p->num_lines && p->line_number[record] == n) {
+			size_t address = lineAddress(p, record);
+			size_t next = ++record < p->num_lines ? lineAddress(p, record) : len;
+			fprintf(f, "%6zu %08zX ", n, address);
+			printListingBytes(f, code + address, next - address);
+			fprintf(f, " %.*s\n", (int)(eol - line), line);
+
+			// Continuation rows for the rest of a long line's bytes
+			for (address += LISTING_BYTES; address < next; address += LISTING_BYTES) {
+				fprintf(f, "%6s %08zX ", "", address);
+				printListingBytes(f, code + address, next - address);
+				fprintf(f, "\n");
 			}
 		}
+		else {
+			fprintf(f, "%6zu %8s %*s %.*s\n", n, "", 2 * LISTING_BYTES, "", (int)(eol - line), line);
+		}
+		line = eol + 1;
+	}
+}
+
+typedef struct MapEntry {
+	size_t   address;
+	uint32_t id;
+} MapEntry;
+
+int mapEntryCompare(const void *a, const void *b) {
+	const MapEntry *x = a, *y = b;
+	if (x->address != y->address) {
+		return x->address < y->address ? -1 : 1;
+	}
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/*
+ * Writes the symbol map: every label sorted by address, with its size, the distance to the next higher
+ * label address or the end of the code
+ * Param f:   Where to write the map
+ * Param p:   The relaxed program
+ * Param len: The size of the emitted code
+ */
+void writeMap(FILE *f, Program *p, size_t len) {
+	MapEntry *entries = malloc(p->num_labels * sizeof(MapEntry) + 1);
+	size_t n = 0;
+	for (uint32_t i = 0; i < p->num_labels; i++) {
+		if (p->label_offset[i] != UNDEFINED_LABEL) {
+			entries[n].address = labelAddress(p, i);
+			entries[n++].id = i;
+		}
+	}
+	qsort(entries, n, sizeof(MapEntry), mapEntryCompare);
+	fprintf(f, "%-16s %-8s %s\n", "Address", "Size", "Label");
+	size_t next = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t address = entries[i].address;
+		if (next <= i) {
+			for (next = i + 1; next < n && entries[next].address == address; next++);
+		}
+		size_t size = (next < n ? entries[next].address : len) - address;
+		String *name = symbols.names + p->label_symbol[entries[i].id];
+		fprintf(f, "%016zX %08zX %.*s\n", address, size, (int)name->len, name->d);
+	}
+	free(entries);
+}
+
 
-		else if (EQUALS(opcode,"dec",3)) {
-			curr_block = makeRoom(1);
-			String dest;
-			getIdentifier(operands, &dest);
-			uint8_t encoded_dest = encodeRegister(&dest);
-			((uint8_t*)(curr_block->data))[curr_block->size] = DEC | encoded_dest;
-			curr_block->size++;
+/*
+ * Handles an equ directive
+ * Param t: The name of the constant, followed by "equ" and the value
+ * Returns: SUCCESS, SYNTAX_ERROR if the value is missing, or SEMANTIC_ERROR if the constant was already defined
+ */
+int defineConstant(Token *t) {
+	if (symbols.constant_line[t->symbol]) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): constant \"%.*s\" is already defined\n",
+		        infile_name, line_num, (int)t->s.len, t->s.d);
+		return SEMANTIC_ERROR;
+	}
+	int64_t value;
+	int status = immediateValue(t+2, &value, 64);
+	if (status == ERROR) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Directive \"equ\" requires an argument\n", infile_name, line_num);
+		return SYNTAX_ERROR;
+	}
+	else if (status != SUCCESS) {
+		return status;
+	}
+	symbols.constant_value[t->symbol] = value;
+	symbols.constant_line[t->symbol] = line_num;
+	return SUCCESS;
+}
+
+/*
+ * Handles a [bits N] directive
+ * Param t: The opening bracket of the directive
+ * Returns: SUCCESS, SYNTAX_ERROR or SEMANTIC_ERROR
+ */
+int setMode(Token *t) {
+	int64_t mode;
+	int status = immediateValue(t+2, &mode, 64);
+	if (status == ERROR) {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): Directive \"BITS\" requires an argument\n", infile_name, line_num);
+		return SYNTAX_ERROR;
+	}
+	else if (status != SUCCESS) {
+		return status;
+	}
+	if (mode == 32) {
+		long_mode = false;
+	}
+	else if (mode == 64) {
+		long_mode = true;
+	}
+	else {
+		fprintf(diagnostics, "Assembler Error (%s:%lu): %li bit mode is not supported\n", infile_name, line_num, mode);
+		return SEMANTIC_ERROR;
+	}
+	return SUCCESS;
+}
+
+static inline bool isConstantDirective(Token *t) {
+	return t->type == TOKEN_IDENTIFIER && t[1].type == TOKEN_IDENTIFIER && EQUALS(t[1].s,"equ",3);
+}
+
+static inline bool isModeDirective(Token *t) {
+	return t->type == TOKEN_LBRACKET && t[1].type == TOKEN_IDENTIFIER && EQUALS(t[1].s, "bits", 4);
+}
+
+/*
+ * Encodes every line of a token stream into the current program
+ * Param t:          The first token of the stream
+ * Param end:        The token to stop at, or NULL to stop at TOKEN_END
+ * Param line_base:  Added to each token's line number
+ * Param define_constants: Whether to handle equ directives; in parallel mode the pre-scan already has
+ * Returns:          SUCCESS or the status of the first error, with line_num left at the failing line
+ */
+int assembleLines(Token *t, Token *end, size_t line_base, bool define_constants) {
+	for (; t != end && t->type != TOKEN_END; t++) {
+
+		line_num = line_base + t->line;
+		STAT_ADD(lines, 1);
+		if (keep_lines) {
+			addLine(line_num, program.code_len, program.num_frags);
+		}
+		Mnemonic *mnemonic = t->type == TOKEN_IDENTIFIER ? findMnemonic(&t->s) : NULL;
+		if (mnemonic) {
+			STAT_ADD(mnemonics[mnemonic - mnemonics], 1);
+			int status = mnemonic->handler(t+1, mnemonic->arg);
+			if (status != SUCCESS) {
+				return status;
+			}
 		}
 
-		else if (EQUALS(opcode,"rep",3)) {
-			String command;
-			getIdentifier(operands, &command);
-			curr_block = makeRoom(2);
-			if (EQUALS(command,"stosb",5)) {
-				*(int16_t*)(curr_block->data+curr_block->size) = REP_STOSB;
+		// Not recognized instruction, check if it's a label or constant
+		else if (t->type == TOKEN_IDENTIFIER) {
+			String name = t->s;
+			if (t[1].type == TOKEN_COLON) {
+				int status = defineLabel(t->symbol);
+				if (status != SUCCESS) {
+					return status;
+				}
 			}
-			else if (EQUALS(command,"stosw",5) || EQUALS(command,"stosd",5)) {
-				*(int16_t*)(curr_block->data+curr_block->size) = REP_STOSD;
+			else if (isConstantDirective(t)) {
+				int status = define_constants ? defineConstant(t) : SUCCESS;
+				if (status != SUCCESS) {
+					return status;
+				}
 			}
 			else {
-				fprintf(stderr, "Assembler Error (%s:%lu): Unsuported instruction: %s\n", infile_name, line_num, opcode);
-				return FEATURE_NOT_IMPLEMENTED_YET;
+				fprintf(diagnostics, "Assembler Error (%s:%lu): unknown instruction \"", infile_name, line_num);
+				fwrite((void*)name.d, sizeof(char), name.len, diagnostics);
+				fputs("\"\n", diagnostics);
+				return SYNTAX_ERROR;
 			}
-			curr_block->size += 2;
 		}
 
-		else if (EQUALS(opcode,"rdmsr",5)) {
-			curr_block = makeRoom(2);
-			*(int16_t*)(curr_block->data+curr_block->size) = RDMSR;
-			curr_block->size += 2;
+		// Check if it's an assembly directive
+		else if (isModeDirective(t)) {
+			int status = setMode(t);
+			if (status != SUCCESS) {
+				return status;
+			}
 		}
 
-		else if (EQUALS(opcode,"wrmsr",5)) {
-			curr_block = makeRoom(2);
-			*(int16_t*)(curr_block->data+curr_block->size) = WRMSR;
-			curr_block->size += 2;
+		while (t->type != TOKEN_NEWLINE) t++;
+	}
+	return SUCCESS;
+}
+
+#include "cache.h"
+
+#define MIN_CHUNK_SIZE 0x10000
+#define MAX_THREADS 0x40
+#define REGION_MIN_SIZE 0x4000
+#define REGION_LABEL_MASK 0xF
+
+// A piece of the input encoded independently of the others in parallel or cached mode
+typedef struct Chunk {
+	char        *d;				// Text of the chunk; every chunk but the last ends in a newline
+	size_t       len;
+	size_t       first_line;	// Line number of the chunk's first line
+	size_t       line_base;		// Added to the line numbers of the chunk's tokens
+	size_t       num_lines;		// Newlines in the chunk
+	TokenStream  tokens;		// Owned by the chunk unless the whole source was lexed at once
+	SymbolTable  symbols;		// Identifiers of a chunk lexed in parallel, until they are interned globally
+	uint32_t    *remap;			// Global symbol id of each of the chunk's symbols
+	Token       *tokens_end;	// First token past the chunk, or NULL if its tokens end in TOKEN_END
+	size_t      *directives;	// Token indices of the equ and bits lines, for the pre-scan
+	size_t       num_directives;
+	bool         start_mode;	// long_mode at the start of the chunk
+	uint64_t     env_hash;		// Hash of the constant definitions before the chunk
+	bool         cached;		// The program was loaded from the cache
+
+	Program      program;		// Label ids are local to the chunk
+	LabelMap     labels;
+	int          status;
+	size_t       error_line;
+	char        *diag;			// Buffered diagnostics
+	size_t       diag_len;
+} Chunk;
+
+// Records the token indices of a chunk's equ and bits lines
+void findDirectives(Chunk *c) {
+	size_t capacity = 0x10;
+	c->directives = malloc(capacity * sizeof(size_t));
+	c->num_directives = 0;
+	Token *t = c->tokens.d;
+	while (t != c->tokens_end && t->type != TOKEN_END) {
+		if (isConstantDirective(t) || isModeDirective(t)) {
+			if (c->num_directives == capacity) {
+				capacity <<= 1;
+				c->directives = realloc(c->directives, capacity * sizeof(size_t));
+			}
+			c->directives[c->num_directives++] = t - c->tokens.d;
 		}
+		while (t->type != TOKEN_NEWLINE) t++;
+		t++;
+	}
+}
 
-		// Not recognized instruction, check if it's a label or constant
-		else if (opcode.len) {
-			size_t remaining = n - offset - opcode.len;
-			if (remaining && opcode.d[opcode.len] == ':') {
-				Label new_label;
-				new_label.name = malloc(opcode.len);
-				memcpy(new_label.name, opcode.d, opcode.len);
-				new_label.name_len = opcode.len;
-				Block *new_block = malloc(sizeof(Block));
-				new_block->next = NULL;
-				new_block->data = NULL;
-				new_block->capacity = 0;
-				new_block->size = 0;
-				new_block->address = curr_block->address + curr_block->size;
-				new_block->line_num = line_num;
-				new_block->opcode = BLOCK;
-				curr_block->next = new_block;
-				curr_block = new_block;
-				new_label.target = curr_block;
-
-				LabelMapInsert(&labels, &new_label);
+// Worker for the first phase of parallel mode: lexes a chunk into its own symbol table and finds its directives
+void lexChunk(Chunk *c) {
+	symbolTableInit(&c->symbols);
+	symbolTableReserve(&c->symbols, countLines(c->d, c->len) / LINES_PER_SYMBOL);
+	lex(c->d, c->len, 0, &c->tokens, &c->symbols);
+	c->num_lines = c->tokens.d[c->tokens.len-1].line;
+	findDirectives(c);
+}
+
+// Interns the symbols of a chunk lexed in parallel in the global table; run serially, in chunk order
+void internChunk(Chunk *c) {
+	SymbolTable *local = &c->symbols;
+	c->remap = malloc(local->num_symbols * sizeof(uint32_t));
+	c->remap[NO_SYMBOL] = NO_SYMBOL;
+	for (size_t i = 1; i < local->num_symbols; i++) {
+		c->remap[i] = symbolIntern(&symbols, local->names[i].d, local->names[i].len);
+	}
+	symbolTableFree(local);
+}
+
+// Worker that rewrites a chunk's tokens to global symbol ids
+void remapChunk(Chunk *c) {
+	for (size_t i = 0; i < c->tokens.len; i++) {
+		c->tokens.d[i].symbol = c->remap[c->tokens.d[i].symbol];
+	}
+	free(c->remap);
+}
+
+// Worker for the second phase: encodes a chunk into the thread's program
+void assembleChunk(Chunk *c) {
+	if (c->cached) {
+		return;
+	}
+	FILE *diag = open_memstream(&c->diag, &c->diag_len);
+	diagnostics = diag;
+	programInit(&program);
+	LabelMapInit(&labels);
+	LabelMapReserve(&labels, countLines(c->d, c->len) / LINES_PER_SYMBOL);
+	long_mode = c->start_mode;
+	c->status = assembleLines(c->tokens.d, c->tokens_end, c->line_base, false);
+	c->error_line = line_num;
+	fclose(diag);
+	c->program = program;
+	c->labels = labels;
+}
+
+typedef struct ChunkQueue {
+	Chunk  *chunks;
+	size_t  n;
+	size_t  next;		// Next chunk to hand out, taken atomically
+	void  (*worker)(Chunk*);
+} ChunkQueue;
+
+void* chunkThread(void *arg) {
+	ChunkQueue *q = arg;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+		if (i >= q->n) {
+			return NULL;
+		}
+		q->worker(q->chunks + i);
+	}
+}
+
+// Runs worker on every chunk using up to num_threads threads
+void runChunks(Chunk *chunks, size_t n, size_t num_threads, void (*worker)(Chunk*)) {
+	ChunkQueue q = {chunks, n, 0, worker};
+	pthread_t threads[MAX_THREADS];
+	if (num_threads > n) num_threads = n;
+	if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+	if (num_threads < 1) num_threads = 1;
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_create(threads + i, NULL, chunkThread, &q);
+	}
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/*
+ * Appends a chunk's program to the current program, resolving its labels against the global label map
+ * Param c:    The chunk to merge
+ * Param line: Output variable set to the line of the first label the chunk redefines, or SIZE_MAX
+ */
+void mergeChunk(Chunk *c, size_t *line) {
+	Program *src = &c->program;
+	Program *dst = &program;
+	size_t code_base = dst->code_len;
+	size_t frag_base = dst->num_frags;
+	memcpy(emitCode(src->code_len), src->code, src->code_len);
+
+	*line = SIZE_MAX;
+	uint32_t *ids = malloc(src->num_labels * sizeof(uint32_t) + 1);
+	for (size_t i = 0; i < src->num_labels; i++) {
+		uint32_t id = labelId(src->label_symbol[i]);
+		ids[i] = id;
+		if (src->label_offset[i] == UNDEFINED_LABEL) {
+			continue;
+		}
+		if (dst->label_offset[id] != UNDEFINED_LABEL) {
+			if (src->label_line[i] < *line) {
+				*line = src->label_line[i];
+			}
+			continue;
+		}
+		dst->label_offset[id] = src->label_offset[i] + code_base;
+		dst->label_fragment[id] = src->label_fragment[i] + frag_base;
+		dst->label_line[id] = src->label_line[i];
+	}
+
+	for (size_t i = 0; i < src->num_frags; i++) {
+		uint32_t target = src->frag_target[i];
+		addFragment(src->frag_kind[i], src->frag_opcode[i], src->frag_kind[i] == FRAGMENT_JUMP ? ids[target] : target);
+		dst->frag_offset[frag_base + i] = src->frag_offset[i] + code_base;
+		dst->frag_line[frag_base + i] = src->frag_line[i];
+	}
+	for (size_t i = 0; i < src->num_lines; i++) {
+		addLine(src->line_number[i], src->line_offset[i] + code_base, src->line_fragment[i] + frag_base);
+	}
+	free(ids);
+}
+
+/*
+ * Splits a lexed source into regions for the cache. Regions start at label definitions chosen by a
+ * hash of the label's name, so an edit only moves the region boundaries next to it.
+ * Param source: The full source text
+ * Param tokens: The tokens of the whole source
+ * Param n:      Output variable set to the number of regions
+ * Returns:      The regions, as chunks whose tokens point into tokens
+ */
+Chunk* splitRegions(Source *source, TokenStream *tokens, size_t *n) {
+	size_t capacity = 0x10;
+	Chunk *chunks = calloc(capacity, sizeof(Chunk));
+	chunks[0].d = source->d;
+	chunks[0].tokens.d = tokens->d;
+	chunks[0].first_line = tokens->d[0].line;
+	*n = 1;
+	for (Token *t = tokens->d; t->type != TOKEN_END; t++) {
+		Chunk *c = chunks + *n - 1;
+		if (t->type == TOKEN_IDENTIFIER && t[1].type == TOKEN_COLON && t->s.d - c->d >= REGION_MIN_SIZE
+		    && !(hashBytes(t->s.d, t->s.len, CACHE_HASH_SEED) & REGION_LABEL_MASK)) {
+			if (*n == capacity) {
+				capacity <<= 1;
+				chunks = realloc(chunks, capacity * sizeof(Chunk));
+				memset(chunks + *n, 0, (capacity - *n) * sizeof(Chunk));
+			}
+			c = chunks + (*n)++;
+			c->d = t->s.d;
+			c->tokens.d = t;
+			c->first_line = t->line;
+		}
+		while (t->type != TOKEN_NEWLINE) t++;
+	}
+	for (size_t i = 0; i < *n; i++) {
+		char *end = i + 1 < *n ? chunks[i+1].d : source->d + source->len;
+		chunks[i].len = end - chunks[i].d;
+		chunks[i].tokens_end = i + 1 < *n ? chunks[i+1].tokens.d : NULL;
+		findDirectives(chunks + i);
+	}
+	return chunks;
+}
+
+/*
+ * Assembles the source as independent chunks, on several threads and/or through the region cache.
+ *
+ * In parallel mode the source is split at line boundaries into chunks that are lexed in parallel,
+ * each into its own symbol table; the tables are then interned globally in order and the tokens
+ * rewritten to global symbol ids.
+ * In cached mode the source is lexed at once and split into regions at labels, and regions whose
+ * text, starting mode and preceding constant definitions match a cache entry are not encoded again.
+ * Either way a serial pre-scan then evaluates every equ and bits directive in order, so workers can
+ * encode the chunks independently into chunk-local programs. The programs are merged in order,
+ * giving the same program, and the same first error, as assembleLines on the whole source.
+ * Param source:      The full source text
+ * Param num_threads: The number of worker threads to use
+ * Param cache_name:  The cache file, or NULL
+ * Returns:           SUCCESS or the status of the first error
+ */
+int assembleChunks(Source *source, size_t num_threads, char *cache_name) {
+	size_t n;
+	Chunk *chunks;
+	TokenStream tokens;
+	if (cache_name) {
+		lex(source->d, source->len, 1, &tokens, &symbols);
+		chunks = splitRegions(source, &tokens, &n);
+	}
+	else {
+		n = source->len / MIN_CHUNK_SIZE;
+		if (n > num_threads) n = num_threads;
+		if (n > MAX_THREADS) n = MAX_THREADS;
+		if (n < 1) n = 1;
+		chunks = calloc(n, sizeof(Chunk));
+		char *start = source->d;
+		char *end = source->d + source->len;
+		for (size_t i = 0; i < n; i++) {
+			char *split = i == n - 1 ? end : source->d + source->len / n * (i + 1);
+			if (split < start) split = start;
+			while (split < end && split[-1] != '\n') split++;
+			chunks[i].d = start;
+			chunks[i].len = split - start;
+			start = split;
+		}
+		runChunks(chunks, n, num_threads, lexChunk);
+		size_t first_line = 1;
+		for (size_t i = 0; i < n; i++) {
+			chunks[i].first_line = chunks[i].line_base = first_line;
+			first_line += chunks[i].num_lines;
+			internChunk(chunks + i);
+		}
+		runChunks(chunks, n, num_threads, remapChunk);
+	}
+
+	// Pre-scan: define constants and track the mode in source order
+	FILE *prescan_diag;
+	char *prescan_text = NULL;
+	size_t prescan_len = 0;
+	prescan_diag = open_memstream(&prescan_text, &prescan_len);
+	diagnostics = prescan_diag;
+	int prescan_status = SUCCESS;
+	size_t prescan_line = SIZE_MAX;
+	uint64_t env_hash = CACHE_HASH_SEED;
+	for (size_t i = 0; i < n; i++) {
+		Chunk *c = chunks + i;
+		c->start_mode = long_mode;
+		c->env_hash = env_hash;
+		for (size_t j = 0; j < c->num_directives && prescan_status == SUCCESS; j++) {
+			Token *t = c->tokens.d + c->directives[j];
+			line_num = c->line_base + t->line;
+			if (isModeDirective(t)) {
+				prescan_status = setMode(t);
 			}
 			else {
-				String equ;
-				getIdentifier(operands, &equ);
-				if (EQUALS(equ,"equ",3)) {
-					Constant new_const;
-					new_const.name = malloc(opcode.len);
-					memcpy(new_const.name, opcode.d, opcode.len);
-					new_const.name_len = opcode.len;
-					sscanf(equ.d+equ.len, " %li", &(new_const.val));
-					ConstantMapInsert(&constants, &new_const);
-				}
-				else {
-					fprintf(stderr, "Assembler Error (%s:%lu): unknown instruction \"", infile_name, line_num);
-					fwrite((void*)opcode.d, sizeof(char), opcode.len, stderr);
-					fputs("\"\n", stderr);
-					return SYNTAX_ERROR;
-				}
+				prescan_status = defineConstant(t);
+				env_hash = hashMix(env_hash ^ hashBytes(t->s.d, t->s.len, CACHE_HASH_SEED));
+				env_hash = hashMix(env_hash ^ hashBytes(t[2].s.d, t[2].s.len, CACHE_HASH_SEED));
 			}
 		}
+		if (prescan_status != SUCCESS && prescan_line == SIZE_MAX) {
+			prescan_line = line_num;
+		}
+		free(c->directives);
+	}
+	fclose(prescan_diag);
+	diagnostics = stderr;
+
+	Cache cache;
+	CacheKey *keys = NULL;
+	if (cache_name) {
+		cacheLoad(&cache, cache_name);
+		keys = calloc(n, sizeof(CacheKey));
+		for (size_t i = 0; i < n; i++) {
+			Chunk *c = chunks + i;
+			keys[i].text_hash = hashBytes(c->d, c->len, CACHE_HASH_SEED);
+			keys[i].env_hash = c->env_hash;
+			keys[i].text_len = c->len;
+			keys[i].mode = c->start_mode | optimize << 1;
+			// Cached regions have no line records, so a listing encodes every region again
+			c->cached = !keep_lines && cacheFind(&cache, keys + i, &c->program, c->first_line, &symbols);
+		}
+	}
 
-		// Check if it's an assembly directive
-		else if (n > offset && *operands == '[') {
-			operands++;
-			getIdentifier(operands, &opcode);
-			if (EQUALS(opcode, "bits", 4)) {
-				operands = opcode.d + opcode.len;
-				uint8_t mode;
-				if (sscanf(operands, " %hhi", &mode) != 1) {
-					fprintf(stderr, "Assembler Error (%s:%lu): Directive \"BITS\" requires an argument\n", infile_name, line_num);
-					return SYNTAX_ERROR;
-				}
-				if (mode == 32) {
-					long_mode = false;
-				}
-				else if (mode == 64) {
-					long_mode = true;
-				}
-				else {
-					fprintf(stderr, "Assembler Error (%s:%lu): %hhi bit mode is not supported\n", infile_name, line_num, mode);
-					return SEMANTIC_ERROR;
+	runChunks(chunks, n, num_threads, assembleChunk);
+	if (cache_name) {
+		freeTokens(&tokens);
+	}
+	else {
+		for (size_t i = 0; i < n; i++) {
+			freeTokens(&chunks[i].tokens);
+		}
+	}
+
+	timerPhase(&timer, "parse");
+
+	// Merge in order; the first error in the source is the first error of the first chunk that has one
+	int status = SUCCESS;
+	for (size_t i = 0; i < n && status == SUCCESS; i++) {
+		Chunk *c = chunks + i;
+		size_t redefined_line;
+		mergeChunk(c, &redefined_line);
+		size_t next_line = i + 1 < n ? chunks[i+1].first_line : SIZE_MAX;
+		size_t error_line = c->status == SUCCESS ? SIZE_MAX : c->error_line;
+		if (prescan_line < next_line && prescan_line <= error_line && prescan_line <= redefined_line) {
+			fwrite(prescan_text, 1, prescan_len, stderr);
+			status = prescan_status;
+		}
+		else if (error_line < redefined_line) {
+			fwrite(c->diag, 1, c->diag_len, stderr);
+			status = c->status;
+		}
+		else if (redefined_line != SIZE_MAX) {
+			for (size_t j = 0; j < c->program.num_labels; j++) {
+				if (c->program.label_line[j] == redefined_line && c->program.label_offset[j] != UNDEFINED_LABEL) {
+					String *name = symbols.names + c->program.label_symbol[j];
+					fprintf(stderr, "Assembler Error (%s:%lu): label \"%.*s\" is already defined\n",
+					        infile_name, redefined_line, (int)name->len, name->d);
 				}
 			}
+			status = SEMANTIC_ERROR;
 		}
 	}
-	
-	free(buffer);
-	fclose(infile);
-
-	Block *end = curr_block;
-	size_t offset = 0;
-	for (curr_block = text_segment; curr_block; curr_block = curr_block->next) {
-		curr_block->address += offset;
-		int16_t op = curr_block->opcode;
-		if (op == SHORT_JMP || op == SHORT_JNZ) {
-			Label *lab = LabelMapGet(&labels, (String*)&(curr_block->data));
-			if (lab == NULL) {
-				fprintf(stderr, "Assembler Error(%s:%lu): unknown label \"", infile_name, curr_block->line_num);
-				fwrite(curr_block->data, sizeof(char), curr_block->capacity, stderr);
-				fputs("\"\n", stderr);
-				return SEMANTIC_ERROR;
+
+	if (cache_name) {
+		if (status == SUCCESS) {
+			Program **programs = malloc(n * sizeof(Program*));
+			size_t *first_lines = malloc(n * sizeof(size_t));
+			for (size_t i = 0; i < n; i++) {
+				programs[i] = &chunks[i].program;
+				first_lines[i] = chunks[i].first_line;
 			}
-			else {
-				free(curr_block->data);
-				curr_block->data = lab->target;
-				offset += setJmpOperand(curr_block);
+			if (!cacheSave(cache_name, keys, programs, first_lines, n, &symbols)) {
+				fprintf(stderr, "Assembler Warning: cannot write cache file %s\n", cache_name);
 			}
+			free(programs);
+			free(first_lines);
+		}
+		free(keys);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		Chunk *c = chunks + i;
+		programFree(&c->program);
+		if (!c->cached) {
+			LabelMapFree(&c->labels);
+		}
+		free(c->diag);
+	}
+	if (cache_name) {
+		cacheFree(&cache);
+	}
+	free(prescan_text);
+	free(chunks);
+	return status;
+}
+
+void printJsonString(FILE *f, char *s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(f, "\\%c", *s);
+		}
+		else if ((uint8_t)*s < 0x20) {
+			fprintf(f, "\\u%04x", *s);
+		}
+		else {
+			fputc(*s, f);
 		}
 	}
+	fputc('"', f);
+}
+
+void printMapStats(FILE *f, char *name, size_t entries, size_t capacity, size_t max_probe_length) {
+	fprintf(f, "\t\"%s\": {\"entries\": %zu, \"capacity\": %zu, \"max_probe_length\": %zu},\n",
+	        name, entries, capacity, max_probe_length);
+}
+
+/*
+ * Prints the --stats report as JSON
+ * Param f:             Where to print the report
+ * Param bytes_emitted: Size of the output file
+ */
+void printStats(FILE *f, size_t bytes_emitted) {
+	fprintf(f, "{\n\t\"input\": ");
+	printJsonString(f, infile_name);
+	fprintf(f, ",\n\t\"phases\": {");
+	for (size_t i = 0; i < timer.num_phases; i++) {
+		fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", timer.names[i], timer.seconds[i]);
+	}
+	fprintf(f, "},\n");
+	fprintf(f, "\t\"fragments\": %zu,\n\t\"labels\": %zu,\n\t\"symbols\": %zu,\n",
+	        program.num_frags, program.num_labels, symbols.num_symbols - 1);
+	printMapStats(f, "label_map", labels.num_entries, labels.mask + 1, labels.max_probe_length);
+	printMapStats(f, "symbol_map", symbols.map.num_entries, symbols.map.mask + 1, symbols.map.max_probe_length);
+#ifdef STATS
+	fprintf(f, "\t\"counters\": {\n");
+	fprintf(f, "\t\t\"lines\": %zu,\n\t\t\"mnemonics\": {", stats.lines);
+	for (size_t i = 0; i < sizeof(mnemonics) / sizeof(Mnemonic); i++) {
+		fprintf(f, "%s\"%s\": %zu", i ? ", " : "", mnemonics[i].name, stats.mnemonics[i]);
+	}
+	fprintf(f, "},\n");
+	fprintf(f, "\t\t\"code_reallocs\": %zu,\n", stats.code_reallocs);
+	fprintf(f, "\t\t\"fragment_reallocs\": %zu,\n", stats.fragment_reallocs);
+	fprintf(f, "\t\t\"label_reallocs\": %zu,\n", stats.label_reallocs);
+	fprintf(f, "\t\t\"relax_visits\": %zu,\n", stats.relax_visits);
+	fprintf(f, "\t\t\"relax_widened\": %zu,\n", stats.relax_widened);
+	fprintf(f, "\t\t\"jumps_resolved\": %zu,\n", stats.jumps_resolved);
+	fprintf(f, "\t\t\"jumps_near\": %zu,\n", stats.jumps_near);
+	fprintf(f, "\t\t\"label_map_operations\": %zu,\n", stats.label_operations);
+	fprintf(f, "\t\t\"label_map_probes\": %zu,\n", stats.label_probes);
+	fprintf(f, "\t\t\"label_map_resizes\": %zu,\n", stats.label_resizes);
+	fprintf(f, "\t\t\"symbol_map_operations\": %zu,\n", stats.symbol_operations);
+	fprintf(f, "\t\t\"symbol_map_probes\": %zu,\n", stats.symbol_probes);
+	fprintf(f, "\t\t\"symbol_map_resizes\": %zu\n", stats.symbol_resizes);
+	fprintf(f, "\t},\n");
+#endif
+	fprintf(f, "\t\"bytes_emitted\": %zu\n}\n", bytes_emitted);
+}
 
-	while (offset) {
-		offset = 0;
-		for (curr_block = text_segment; curr_block; curr_block = curr_block->next) {
-			curr_block->address += offset;
-			switch (curr_block->opcode) {
-				case (SHORT_JMP) :
-				case (NEAR_JMP) : 
-				case (SHORT_JNZ) :
-				case (NEAR_JNZ) : {
-					offset += setJmpOperand(curr_block);
+int main(int argc, char **argv) {
+	char *outfile_name = NULL;
+	bool o_flag = false;
+	bool j_flag = false;
+	bool l_flag = false;
+	bool m_flag = false;
+	char *listing_name = NULL;
+	char *map_name = NULL;
+	bool arena_stats = false;
+	bool timings = false;
+	char *stats_name = NULL;
+	bool use_cache = false;
+	char *cache_name = NULL;
+	char *lexer_name = NULL;
+	size_t num_threads = 1;
+	for (size_t i = 1; i < argc; i++) {
+		if (o_flag) {
+			outfile_name = argv[i];
+			o_flag = false;
+		}
+		else if (j_flag) {
+			num_threads = strtoul(argv[i], NULL, 10);
+			j_flag = false;
+		}
+		else if (l_flag) {
+			listing_name = argv[i];
+			l_flag = false;
+		}
+		else if (m_flag) {
+			map_name = argv[i];
+			m_flag = false;
+		}
+		else if (!strcmp(argv[i], "--arena-stats")) {
+			arena_stats = true;
+		}
+		else if (!strcmp(argv[i], "--timings")) {
+			timings = true;
+		}
+		else if (!strcmp(argv[i], "--stats")) {
+			stats_name = "-";
+		}
+		else if (!strncmp(argv[i], "--stats=", 8)) {
+			stats_name = argv[i] + 8;
+		}
+		else if (!strcmp(argv[i], "--cache")) {
+			use_cache = true;
+		}
+		else if (!strncmp(argv[i], "--cache=", 8)) {
+			use_cache = true;
+			cache_name = argv[i] + 8;
+		}
+		else if (!strncmp(argv[i], "--lexer=", 8)) {
+			lexer_name = argv[i] + 8;
+		}
+		else if (argv[i][0] == '-' && argv[i][1]) {
+			for (char *j = argv[i] + 1; *j; j++) {
+				if (*j == 'o') {
+					o_flag = true;
+				}
+				else if (*j == 'j' && j[1] >= '0' && j[1] <= '9') {
+					// Attached thread count, as in -j4
+					num_threads = strtoul(j + 1, &j, 10);
+					j--;
+				}
+				else if (*j == 'j') {
+					j_flag = true;
+				}
+				else if (*j == 'O') {
+					optimize = true;
+				}
+				else if (*j == 'l') {
+					l_flag = true;
+				}
+				else if (*j == 'm') {
+					m_flag = true;
 				}
-				default : {}
 			}
 		}
+		else {
+			infile_name = argv[i];
+		}
+	}
+	if (!infile_name) {
+		fprintf(stderr, "Assembler Error: No input file\n");
+		return USAGE_ERROR;
+	}
+	if (!outfile_name) {
+		outfile_name = "out.elf";
+	}
+	if (use_cache && !cache_name) {
+		// Default to a cache next to the output
+		size_t len = strlen(outfile_name);
+		cache_name = malloc(len + 7);
+		memcpy(cache_name, outfile_name, len);
+		memcpy(cache_name + len, ".cache", 7);
+	}
+	if (!lexSelect(lexer_name)) {
+		fprintf(stderr, "Assembler Error: lexer \"%s\" is not supported on this machine\n", lexer_name);
+		return USAGE_ERROR;
+	}
+	timerStart(&timer);
+	Source source;
+	if (!readSource(infile_name, &source)) {
+		fprintf(stderr, "Assembler Error (%s:1): cannot open file for reading\n", infile_name);
+		return IO_ERROR;
+	}
+
+	if (!buildMnemonicTable() || !buildRegisterTable()) {
+		fprintf(stderr, "Assembler Error: cannot build lookup tables\n");
+		return ERROR;
+	}
+
+	timerPhase(&timer, "read");
+
+	diagnostics = stderr;
+	keep_lines = listing_name != NULL;
+	symbolTableInit(&symbols);
+	programInit(&program);
+	LabelMapInit(&labels);
+	size_t expected_symbols = countLines(source.d, source.len) / LINES_PER_SYMBOL;
+	symbolTableReserve(&symbols, expected_symbols);
+	LabelMapReserve(&labels, expected_symbols);
+
+	int status;
+	if (num_threads > 1 || cache_name) {
+		status = assembleChunks(&source, num_threads, cache_name);
+	}
+	else {
+		TokenStream tokens;
+		lex(source.d, source.len, 1, &tokens, &symbols);
+		timerPhase(&timer, "lex");
+		status = assembleLines(tokens.d, NULL, 0, true);
+		freeTokens(&tokens);
+		timerPhase(&timer, "parse");
 	}
+	if (!listing_name) {
+		freeSource(&source);
+	}
+	if (status == SUCCESS) {
+		status = resolveLabels(&program);
+	}
+	if (status != SUCCESS) {
+		return status;
+	}
+	timerPhase(&timer, "resolve");
+
+	relaxJumps(&program);
+	timerPhase(&timer, "relax");
 
 	// Write ELF Header
 	ElfHeader header;
@@ -1032,6 +2429,9 @@ int main(int argc, char **argv) {
 	header.ident_version        = ORIGINAL_ELF;
 	header.ident_os_abi         = SYSTEM_V;
 	header.ident_abi_version    = 0;
+	header.ident_pad_one        = 0;
+	header.ident_pad_two        = 0;
+	header.ident_pad_three      = 0;
 	header.type                 = ET_EXEC;
 	header.machine              = X86_64;
 	header.version              = ORIGINAL_ELF;
@@ -1049,14 +2449,15 @@ int main(int argc, char **argv) {
 	String start_str;
 	start_str.d = "_start";
 	start_str.len = 6;
-	Label *start_label = LabelMapGet(&labels, &start_str);
-	if (start_label) {
-		header.entry = start_label->target->address;
+	uint32_t start_symbol = symbolFind(&symbols, &start_str);
+	Label *start_label = start_symbol == NO_SYMBOL ? NULL : LabelMapGet(&labels, &start_symbol);
+	if (start_label && program.label_offset[start_label->id] != UNDEFINED_LABEL) {
+		header.entry = labelAddress(&program, start_label->id);
 	}
 
 	LabelMapFree(&labels);
 
-	size_t segment_size = end->address + end->size;
+	size_t segment_size = program.code_len + program.frag_shift[program.num_frags];
 
 	// Write Program Header for text segment
 	ElfProgramHeader text_header;
@@ -1069,44 +2470,60 @@ int main(int argc, char **argv) {
 	text_header.memsz   = segment_size;
 	text_header.align   = 8;
 
-	FILE *outfile = fopen(outfile_name ? outfile_name : "out.elf", "w");
-	if (!outfile) {
+	Output outfile;
+	if (!openOutput(outfile_name, ELF_HEADER_SIZE + PH_ENTRY_SIZE + segment_size, &outfile)) {
 		fprintf(stderr, "Assembler Error (%s:1): cannot open file for writing\n", outfile_name);
 		return IO_ERROR;
 	}
-	
-	fwrite((void*) &header, ELF_HEADER_SIZE, 1, outfile);
-	fwrite((void*) &text_header, PH_ENTRY_SIZE, 1, outfile);
-	
-	for (curr_block = text_segment; curr_block; curr_block = curr_block->next) {
-		int op_size = sizeof(int8_t);
-		switch (curr_block->opcode) {
-			case (BLOCK) : {
-				fwrite((void*) curr_block->data, 1, curr_block->size, outfile);
-				break;
-			}
-			case (SHORT_JMP) :
-			case (SHORT_JNZ) : {
-				int16_t to_write = curr_block->opcode | ((curr_block->operand & 0xFF) << 8);
-				fwrite((void*) &to_write, sizeof(int16_t), 1, outfile);
-				break;
-			}
-			case (NEAR_JNZ) : {
-				op_size = sizeof(int16_t);
-			}
-			case (NEAR_JMP) : {
-				fwrite((void*) &(curr_block->opcode), op_size, 1, outfile);
-				if (curr_block->long_mode) {
-					fwrite((void*) &(curr_block->operand), sizeof(int32_t), 1, outfile);
-				}
-				else {
-					fwrite((void*) &(curr_block->operand), sizeof(int16_t), 1, outfile);
-				}
-				break;
-			}
+	memcpy(outfile.d, &header, ELF_HEADER_SIZE);
+	memcpy(outfile.d + ELF_HEADER_SIZE, &text_header, PH_ENTRY_SIZE);
+	uint8_t *code = (uint8_t*) outfile.d + ELF_HEADER_SIZE + PH_ENTRY_SIZE;
+	emitProgram(&program, code);
+	char *outputs[] = {listing_name, map_name};
+	for (size_t i = 0; i < 2; i++) {
+		if (!outputs[i]) {
+			continue;
+		}
+		FILE *f = fopen(outputs[i], "w");
+		if (!f) {
+			fprintf(stderr, "Assembler Error: cannot open %s for writing\n", outputs[i]);
+			return IO_ERROR;
 		}
+		if (outputs[i] == listing_name) {
+			writeListing(f, &program, &source, code, segment_size);
+			freeSource(&source);
+		}
+		else {
+			writeMap(f, &program, segment_size);
+		}
+		fclose(f);
+	}
+	if (!closeOutput(&outfile)) {
+		fprintf(stderr, "Assembler Error (%s:1): cannot write file\n", outfile_name);
+		return IO_ERROR;
+	}
+
+	timerPhase(&timer, "write");
+
+	if (timings) {
+		timerPrint(&timer, stderr);
+	}
+	if (stats_name) {
+		FILE *f = strcmp(stats_name, "-") ? fopen(stats_name, "w") : stderr;
+		if (!f) {
+			fprintf(stderr, "Assembler Error: cannot open %s for writing\n", stats_name);
+			return IO_ERROR;
+		}
+		printStats(f, ELF_HEADER_SIZE + PH_ENTRY_SIZE + segment_size);
+		if (f != stderr) {
+			fclose(f);
+		}
+	}
+	if (arena_stats) {
+		arenaPrintStats(&symbols.arena, stderr);
 	}
-	fclose(outfile);
+	programFree(&program);
+	symbolTableFree(&symbols);
 
 	return SUCCESS;
 }
@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Measures assembler throughput on generated sources.
+// Usage: bench [-a ASSEMBLER] [-g GENERATOR] [-d DIR] [-s SIZES] [-j THREADS] [-r RUNS] [-c COMMENTS] [-x ARG]...
+// SIZES and THREADS are comma separated lists. Each source size is assembled RUNS times with each
+// thread count; the fastest run is reported along with the largest peak RSS of any run.
+// COMMENTS is passed to the generator, and each -x adds an argument to every assembler command.
+
+#define MAX_LIST 0x20
+#define MAX_PHASES 0x10
+#define PHASE_NAME_LEN 0x20
+#define OUTPUT_LEN 0x1000
+#define MAX_EXTRA_ARGS 8
+
+typedef struct Run {
+	double seconds;
+	long   peak_rss;	// KiB
+	size_t num_phases;
+	char   phase_names[MAX_PHASES][PHASE_NAME_LEN];
+	double phase_seconds[MAX_PHASES];
+} Run;
+
+static inline double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+size_t parseList(char *s, size_t *list) {
+	size_t n = 0;
+	for (char *p = strtok(s, ", "); p && n < MAX_LIST; p = strtok(NULL, ", ")) {
+		list[n++] = strtoull(p, NULL, 10);
+	}
+	return n;
+}
+
+/*
+ * Runs a command, optionally redirecting its standard output to a file and capturing its standard error
+ * Param argv:     The command
+ * Param out_name: File to write standard output to, or NULL
+ * Param err:      Buffer for standard error, or NULL to discard it
+ * Param usage:    Output variable set to the resources used by the command
+ * Returns:        The exit status, or -1 if the command could not be run
+ */
+int runCommand(char **argv, char *out_name, char *err, struct rusage *usage) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds)) {
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (out_name) {
+			int fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			dup2(fd, STDOUT_FILENO);
+		}
+		dup2(pipe_fds[1], STDERR_FILENO);
+		close(pipe_fds[0]);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	size_t len = 0;
+	char discard[OUTPUT_LEN];
+	for (;;) {
+		char *buf = err ? err + len : discard;
+		size_t space = err ? OUTPUT_LEN - 1 - len : OUTPUT_LEN;
+		ssize_t n = read(pipe_fds[0], buf, space ? space : 1);
+		if (n <= 0) break;
+		if (err && space) len += n;
+	}
+	if (err) err[len] = '\0';
+	close(pipe_fds[0]);
+	int status;
+	if (pid < 0 || wait4(pid, &status, 0, usage) < 0) {
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Reads the "Phase NAME: SECONDS s" lines printed by the assembler's --timings option
+void parsePhases(char *err, Run *run) {
+	run->num_phases = 0;
+	for (char *line = strstr(err, "Phase "); line && run->num_phases < MAX_PHASES; line = strstr(line + 1, "Phase ")) {
+		size_t i = run->num_phases;
+		if (sscanf(line, "Phase %31[^:]: %lf", run->phase_names[i], run->phase_seconds + i) == 2) {
+			run->num_phases++;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	char *assembler = "./assemble";
+	char *generator = "tools/bench/gen-source";
+	char *dir = ".bench";
+	char default_sizes[] = "1000,10000,100000,1000000";
+	char default_threads[] = "1";
+	char *sizes_arg = default_sizes;
+	char *threads_arg = default_threads;
+	size_t runs = 3;
+	char *comments = "0";
+	char *extra_args[MAX_EXTRA_ARGS];
+	size_t num_extra_args = 0;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-a")) assembler = argv[i+1];
+		else if (!strcmp(argv[i], "-g")) generator = argv[i+1];
+		else if (!strcmp(argv[i], "-d")) dir = argv[i+1];
+		else if (!strcmp(argv[i], "-s")) sizes_arg = argv[i+1];
+		else if (!strcmp(argv[i], "-j")) threads_arg = argv[i+1];
+		else if (!strcmp(argv[i], "-r")) runs = strtoull(argv[i+1], NULL, 10);
+		else if (!strcmp(argv[i], "-c")) comments = argv[i+1];
+		else if (!strcmp(argv[i], "-x") && num_extra_args < MAX_EXTRA_ARGS) extra_args[num_extra_args++] = argv[i+1];
+		else {
+			fprintf(stderr, "Usage: %s [-a ASSEMBLER] [-g GENERATOR] [-d DIR] [-s SIZES] [-j THREADS] [-r RUNS] "
+			        "[-c COMMENTS] [-x ARG]...\n", argv[0]);
+			return 1;
+		}
+	}
+	size_t sizes[MAX_LIST], threads[MAX_LIST];
+	size_t num_sizes = parseList(sizes_arg, sizes);
+	size_t num_threads = parseList(threads_arg, threads);
+	if (runs < 1) runs = 1;
+	mkdir(dir, 0777);
+
+	printf("%10s %12s %7s %9s %12s %9s %9s  %s\n",
+	       "lines", "bytes", "threads", "seconds", "lines/s", "MB/s", "peak MB", "phases (s)");
+	int ret = 0;
+	for (size_t i = 0; i < num_sizes; i++) {
+		char source[0x200], output[0x200], lines[0x20];
+		if (strtoull(comments, NULL, 10)) {
+			snprintf(source, sizeof(source), "%s/bench-%zu-c%s.s", dir, sizes[i], comments);
+		}
+		else {
+			snprintf(source, sizeof(source), "%s/bench-%zu.s", dir, sizes[i]);
+		}
+		snprintf(output, sizeof(output), "%s/bench-%zu.elf", dir, sizes[i]);
+		snprintf(lines, sizeof(lines), "%zu", sizes[i]);
+
+		struct stat info;
+		if (stat(source, &info)) {
+			char *gen_argv[] = {generator, lines, "1", comments, NULL};
+			struct rusage usage;
+			if (runCommand(gen_argv, source, NULL, &usage) || stat(source, &info)) {
+				fprintf(stderr, "bench: cannot generate %s\n", source);
+				return 1;
+			}
+		}
+
+		for (size_t j = 0; j < num_threads; j++) {
+			char thread_arg[0x20];
+			snprintf(thread_arg, sizeof(thread_arg), "%zu", threads[j]);
+			char *asm_argv[8 + MAX_EXTRA_ARGS] = {assembler, source, "-o", output, "--timings", "-j", thread_arg};
+			memcpy(asm_argv + 7, extra_args, num_extra_args * sizeof(char*));
+			asm_argv[7 + num_extra_args] = NULL;
+			Run best = {.seconds = 1e30};
+			long peak_rss = 0;
+			for (size_t r = 0; r < runs; r++) {
+				char err[OUTPUT_LEN];
+				struct rusage usage;
+				double start = now();
+				int status = runCommand(asm_argv, NULL, err, &usage);
+				double seconds = now() - start;
+				if (status) {
+					fprintf(stderr, "bench: %s failed on %s (status %d)\n%s", assembler, source, status, err);
+					ret = 1;
+					break;
+				}
+				if (usage.ru_maxrss > peak_rss) {
+					peak_rss = usage.ru_maxrss;
+				}
+				if (seconds < best.seconds) {
+					best.seconds = seconds;
+					parsePhases(err, &best);
+				}
+			}
+			if (ret) {
+				continue;
+			}
+
+			printf("%10zu %12ld %7zu %9.4f %12.0f %9.2f %9.1f ",
+			       sizes[i], (long)info.st_size, threads[j], best.seconds, sizes[i] / best.seconds,
+			       info.st_size / best.seconds / 1e6, peak_rss / 1024.0);
+			for (size_t k = 0; k < best.num_phases; k++) {
+				printf(" %s %.4f", best.phase_names[k], best.phase_seconds[k]);
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	return ret;
+}
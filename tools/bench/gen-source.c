@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Generates a synthetic assembly source that uses every construct the assembler supports.
+// Usage: gen-source LINES [SEED] [COMMENTS]
+// COMMENTS is the percentage of lines that end in a comment, like a hand written source (default 0).
+// The output is deterministic for a given LINES, SEED and COMMENTS, and always assembles.
+
+#define MAX_CONSTANTS 0x40
+#define JUMP_WINDOW 4		// Jumps target one of the last or next few labels
+#define FAR_JUMP_CHANCE 50	// One jump in this many targets a distant label
+
+uint64_t rng_state;
+
+static inline uint64_t next() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static inline size_t below(size_t n) {
+	return next() % n;
+}
+
+#define CHOOSE(a) (a[below(sizeof(a) / sizeof(a[0]))])
+
+char *regs8[] = {"al", "bl", "cl", "dl", "ah", "bh", "ch", "dh"};
+char *regs16[] = {"ax", "bx", "cx", "dx", "si", "di"};
+char *regs32[] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+char *regs64[] = {"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r12", "r13", "r15"};
+char *addr_regs[] = {"eax", "ebx", "edi", "esi"};
+char *alu_ops[] = {"add", "or", "and", "xor"};
+char *data_directives[] = {"db", "dw", "dd", "dq"};
+char *read_crs[] = {"cr0", "cr2", "cr3", "cr4"};
+char *write_crs[] = {"cr0", "cr3", "cr4"};
+char *repeated[] = {"stosb", "stosd"};
+char *repeated64[] = {"stosb", "stosd", "stosq", "movsq"};
+char *fixed[] = {"rdmsr", "wrmsr"};
+long data_limits[] = {0x7F, 0x7FFF, 0x40000000, 0x40000000};
+
+char *comments[] = {
+	"; Limit (low)",
+	"; Null tag to terminate list of tags",
+	"; Address of first mapped physical memory, OR'd with 3",
+	"; Enable paging: set bit 31 [PG] of cr0",
+};
+
+size_t comment_percent = 0;
+bool long_mode = false;		// Whether the source is 64 bit code, which can also use 64 bit registers
+size_t num_constants = 0;
+size_t num_labels = 0;
+size_t max_target = 0;	// Highest label number referenced so far
+
+void printTarget(size_t target) {
+	printf("L%zu", target);
+	if (target > max_target) {
+		max_target = target;
+	}
+}
+
+void printJump() {
+	printf("\t%s ", below(2) ? "jmp" : "jnz");
+	if (num_labels && !below(FAR_JUMP_CHANCE)) {
+		printTarget(below(num_labels));
+	}
+	else if (num_labels && below(2)) {
+		size_t back = below(num_labels < JUMP_WINDOW ? num_labels : JUMP_WINDOW);
+		printTarget(num_labels - 1 - back);
+	}
+	else {
+		printTarget(num_labels + below(JUMP_WINDOW));
+	}
+}
+
+void printMove() {
+	size_t form = below(10);
+	if (form < 3 && long_mode && below(2)) {
+		printf("\tmov %s, %s", CHOOSE(regs64), CHOOSE(regs64));
+	}
+	else if (form < 3) {
+		printf("\tmov %s, %s", CHOOSE(regs32), CHOOSE(regs32));
+	}
+	else if (form < 5) {
+		switch (below(3)) {
+			case 0: printf("\tmov %s, %zu", CHOOSE(regs8), below(100)); break;
+			case 1: printf("\tmov %s, %zu", CHOOSE(regs16), below(100)); break;
+			default: printf("\tmov %s, %zu", CHOOSE(regs32), below(100)); break;
+		}
+	}
+	else if (form < 6 && num_constants) {
+		printf("\tmov %s, C%zu", CHOOSE(regs32), below(num_constants));
+	}
+	else if (form < 7 && num_constants) {
+		printf("\tmov DWORD [%s], C%zu", CHOOSE(addr_regs), below(num_constants));
+	}
+	else if (form < 8) {
+		printf("\tmov [%s], %s", CHOOSE(addr_regs), CHOOSE(regs32));
+	}
+	// Control register moves always use the full width register of the mode
+	else if (form < 9) {
+		printf("\tmov %s, %s", long_mode ? CHOOSE(regs64) : CHOOSE(regs32), CHOOSE(read_crs));
+	}
+	else {
+		printf("\tmov %s, %s", CHOOSE(write_crs), long_mode ? CHOOSE(regs64) : CHOOSE(regs32));
+	}
+}
+
+void printArithmetic() {
+	char *op = CHOOSE(alu_ops);
+	size_t width = below(5);
+	if (width == 0) {
+		printf("\t%s %s, ", op, CHOOSE(regs8));
+		below(2) ? printf("%s", CHOOSE(regs8)) : printf("%zu", below(100));
+	}
+	else if (width == 1) {
+		printf("\t%s %s, ", op, CHOOSE(regs16));
+		below(2) ? printf("%s", CHOOSE(regs16)) : printf("%zu", below(100));
+	}
+	else if (width == 4 && long_mode) {
+		printf("\t%s %s, ", op, CHOOSE(regs64));
+		below(2) ? printf("%s", CHOOSE(regs64)) : printf("%zu", below(100));
+	}
+	else {
+		printf("\t%s %s, ", op, CHOOSE(regs32));
+		size_t src = below(4);
+		if (src < 2) {
+			printf("%s", CHOOSE(regs32));
+		}
+		else if (src < 3 && num_constants) {
+			printf("C%zu", below(num_constants));
+		}
+		else {
+			printf("%zu", below(100));
+		}
+	}
+}
+
+void printData() {
+	size_t i = below(4);
+	if (num_constants && below(10) < 3) {
+		printf("\t%s C%zu", data_directives[i], below(num_constants));
+	}
+	else {
+		printf("\t%s %ld", data_directives[i], (long)below(data_limits[i]));
+	}
+}
+
+// Ends the current line, sometimes with a comment padded out to a column
+void endLine() {
+	if (comment_percent && below(100) < comment_percent) {
+		printf("%*s%s", (int)below(8) + 1, "", CHOOSE(comments));
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s LINES [SEED] [COMMENTS]\n", argv[0]);
+		return 1;
+	}
+	size_t lines = strtoull(argv[1], NULL, 10);
+	rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+	rng_state = rng_state * 0x9E3779B97F4A7C15 | 1;
+	comment_percent = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+
+	long_mode = !below(2);
+	printf("[bits %d]\n", long_mode ? 64 : 32);
+	for (size_t i = 1; i < lines; i++) {
+		size_t k = below(100);
+		if (k < 2 && num_constants < MAX_CONSTANTS) {
+			printf("C%zu equ 0x%lx ; constant", num_constants++, (long)below(0x80000000));
+		}
+		else if (k < 12) {
+			printf("L%zu:", num_labels++);
+		}
+		else if (k < 19) {
+			printJump();
+		}
+		else if (k < 26) {
+			printData();
+		}
+		else if (k < 46) {
+			printArithmetic();
+		}
+		else if (k < 71) {
+			printMove();
+		}
+		else if (k < 76) {
+			printf("\tdec %s", long_mode && below(2) ? CHOOSE(regs64) : CHOOSE(regs32));
+		}
+		else if (k < 79) {
+			printf("\trep %s", long_mode ? CHOOSE(repeated64) : CHOOSE(repeated));
+		}
+		else if (k < 81) {
+			printf("\t%s", CHOOSE(fixed));
+		}
+		else if (k >= 88) {
+			printf("\t; comment line with words, and: punctuation [x]");
+		}
+		endLine();
+	}
+
+	// Define every label that was jumped to but not reached
+	for (; num_labels <= max_target; num_labels++) {
+		printf("L%zu:\n", num_labels);
+	}
+	printf("_start:\n\tjmp _start\n");
+	return 0;
+}
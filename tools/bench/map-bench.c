@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map-common.h"
+
+// Compares the two hash-map.h engines on assembler-like symbol sets.
+// Usage: map-bench [LOOKUPS]
+// Each key set is inserted into a map of each engine until the map reaches the target load factor
+// for a small (cache resident) and a large capacity, then every key is looked up, and as many keys
+// that are not in the map. LOOKUPS is the number of lookups timed for each case (default 4000000).
+// Finally every key is erased and replaced by a new one, and the longest probe is reported again.
+// The same keys are also built into a new map at once with MapBulkBuild, in order of home slot.
+
+typedef Name RobinName;
+typedef Name SwissName;
+
+#define QTYPE String
+#define D_HASH(d) (hashString((d)->name, (d)->name_len))
+#define Q_HASH(q) (hashString((q)->d, (q)->len))
+#define DELETE(d) {}
+#define VALID(d) ((d).name)
+#define EQ(e,q) (EQUALS((*q),(e).name,(e).name_len))
+
+#define DTYPE RobinName
+#include "../hash-map.h"
+
+#undef DTYPE
+#define DTYPE SwissName
+#define SWISS_MAP
+#include "../hash-map.h"
+#undef SWISS_MAP
+
+#define SMALL_CAPACITY 0x400
+#define LARGE_CAPACITY 0x100000
+#define NAME_LEN 0x20
+
+double load_factors[] = {0.25, 0.5, 0.75, 0.875};
+
+// Numbered labels, as in generated sources
+void labelName(char *d, size_t i, bool miss) {
+	snprintf(d, NAME_LEN, miss ? "M%zu" : "L%zu", i);
+}
+
+// Lowercase words joined by underscores, as in hand written sources
+void wordName(char *d, size_t i, bool miss) {
+	size_t len = 0;
+	for (size_t words = 1 + next() % 3; words--; ) {
+		for (size_t n = 3 + next() % 6; n-- && len < NAME_LEN - 12; ) {
+			d[len++] = 'a' + next() % 26;
+		}
+		d[len++] = '_';
+	}
+	snprintf(d + len, NAME_LEN - len, "%s%zu", miss ? "x" : "", i);
+}
+
+typedef struct KeySet {
+	char  *name;
+	void (*make)(char *d, size_t i, bool miss);
+} KeySet;
+
+KeySet key_sets[] = {{"labels", labelName}, {"words", wordName}};
+
+typedef struct Result {
+	double insert_ns;
+	double hit_ns;
+	double miss_ns;
+	double churn_ns;			// Per erase and insert
+	double bulk_ns;
+	size_t max_probe_length;
+	size_t churn_max_probe_length;
+} Result;
+
+// Runs the benchmark for one engine; names holds n hit keys followed by n miss keys
+#define BENCH_ENGINE(T, result, names, n, lookups) { \
+	T##Map map; \
+	T##MapInit(&map); \
+	double start = now(); \
+	for (size_t i = 0; i < n; i++) { \
+		T entry = {names[i].d, names[i].len, i}; \
+		T##MapInsert(&map, &entry); \
+	} \
+	result.insert_ns = (now() - start) * 1e9 / n; \
+	size_t found = 0; \
+	start = now(); \
+	for (size_t i = 0; i < lookups; i++) { \
+		found += T##MapGet(&map, names + i % n) != NULL; \
+	} \
+	result.hit_ns = (now() - start) * 1e9 / lookups; \
+	start = now(); \
+	for (size_t i = 0; i < lookups; i++) { \
+		found += T##MapGet(&map, names + n + i % n) != NULL; \
+	} \
+	result.miss_ns = (now() - start) * 1e9 / lookups; \
+	result.max_probe_length = map.max_probe_length; \
+	bool consistent = found == lookups && map.mask + 1 == capacity; \
+	start = now(); \
+	for (size_t i = 0; i < n; i++) { \
+		T entry = {names[n+i].d, names[n+i].len, n + i}; \
+		consistent = consistent && T##MapErase(&map, names + i); \
+		T##MapInsert(&map, &entry); \
+	} \
+	result.churn_ns = (now() - start) * 1e9 / n; \
+	result.churn_max_probe_length = map.max_probe_length; \
+	for (size_t i = 0; i < n; i++) { \
+		consistent = consistent && !T##MapGet(&map, names + i) && T##MapGet(&map, names + n + i); \
+	} \
+	if (!consistent || map.num_entries != n) { \
+		fprintf(stderr, "map-bench: " #T " map is inconsistent\n"); \
+		exit(1); \
+	} \
+	T##MapFree(&map); \
+	T *entries = malloc(n * sizeof(T)); \
+	for (size_t i = 0; i < n; i++) { \
+		entries[i] = (T){names[i].d, names[i].len, i}; \
+	} \
+	T##MapInit(&map); \
+	start = now(); \
+	T##MapBulkBuild(&map, entries, n, true); \
+	result.bulk_ns = (now() - start) * 1e9 / n; \
+	for (size_t i = 0; i < n; i++) { \
+		T *found = T##MapGet(&map, names + i); \
+		consistent = consistent && found && found->id == i; \
+	} \
+	if (!consistent || map.num_entries != n) { \
+		fprintf(stderr, "map-bench: bulk built " #T " map is inconsistent\n"); \
+		exit(1); \
+	} \
+	T##MapFree(&map); \
+	free(entries); \
+}
+
+void printResult(char *keys, char *engine, size_t capacity, double load, Result *r) {
+	printf("%-6s %-8s %9zu %5.3f %10.2f %10.2f %10.2f %9zu %10.2f %11zu %10.2f\n", keys, engine, capacity, load,
+	       r->insert_ns, r->hit_ns, r->miss_ns, r->max_probe_length, r->churn_ns, r->churn_max_probe_length, r->bulk_ns);
+}
+
+int main(int argc, char **argv) {
+	size_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+	size_t capacities[] = {SMALL_CAPACITY, LARGE_CAPACITY};
+	printf("%-6s %-8s %9s %5s %10s %10s %10s %9s %10s %11s %10s\n", "keys", "engine", "capacity", "load",
+	       "insert ns", "hit ns", "miss ns", "max probe", "churn ns", "churn probe", "bulk ns");
+	for (size_t k = 0; k < sizeof(key_sets) / sizeof(KeySet); k++) {
+		for (size_t c = 0; c < 2; c++) {
+			size_t capacity = capacities[c];
+			for (size_t l = 0; l < sizeof(load_factors) / sizeof(double); l++) {
+				size_t n = load_factors[l] * capacity;
+				char *text = malloc(2 * n * NAME_LEN);
+				String *names = malloc(2 * n * sizeof(String));
+				for (size_t i = 0; i < 2 * n; i++) {
+					names[i].d = text + i * NAME_LEN;
+					key_sets[k].make(names[i].d, i % n, i >= n);
+					names[i].len = strlen(names[i].d);
+				}
+				Result robin, swiss;
+				BENCH_ENGINE(RobinName, robin, names, n, lookups);
+				BENCH_ENGINE(SwissName, swiss, names, n, lookups);
+				printResult(key_sets[k].name, "robin", capacity, load_factors[l], &robin);
+				printResult(key_sets[k].name, "swiss", capacity, load_factors[l], &swiss);
+				fflush(stdout);
+				free(text);
+				free(names);
+			}
+		}
+	}
+	return 0;
+}
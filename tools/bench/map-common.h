@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Keys, hashes and helpers shared by the hash-map.h benchmarks. The definitions mirror the
+// assembler's, which live in assembler.c and cannot be included on their own.
+
+#define EQUALS(left,right,size) ((left).len == (size) && !strncmp((left).d, (right), (size)))
+
+typedef struct String {
+	char   *d;
+	size_t  len;
+} String;
+
+#define SYMBOL_HASH_MULTIPLIER 0x9E3779B97F4A7C15
+
+// The assembler's symbol hash
+size_t hashString(char *d, size_t len) {
+	uint64_t hash = len * SYMBOL_HASH_MULTIPLIER;
+	for (; len >= 8; d += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, d, 8);
+		hash = (hash ^ w) * SYMBOL_HASH_MULTIPLIER;
+	}
+	// The last bytes are gathered with fixed size loads, since a variable length copy goes through memory
+	uint64_t w = 0;
+	size_t shift = 0;
+	if (len & 4) {
+		uint32_t part;
+		memcpy(&part, d, 4);
+		w = part;
+		d += 4;
+		shift = 32;
+	}
+	if (len & 2) {
+		uint16_t part;
+		memcpy(&part, d, 2);
+		w |= (uint64_t)part << shift;
+		d += 2;
+		shift += 16;
+	}
+	if (len & 1) {
+		w |= (uint64_t)(uint8_t)*d << shift;
+	}
+	hash = (hash ^ w) * SYMBOL_HASH_MULTIPLIER;
+	return hash ^ (hash >> 32);
+}
+
+// The assembler's label hash
+static inline size_t symbolIdHash(uint32_t id) {
+	uint64_t hash = id * SYMBOL_HASH_MULTIPLIER;
+	return hash ^ (hash >> 32);
+}
+
+// Laid out like the assembler's symbols
+typedef struct Name {
+	char     *name;
+	size_t    name_len;
+	uint32_t  id;
+} Name;
+
+// Xorshift generator, with a state per thread where threads need one
+static inline uint64_t nextRandom(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+uint64_t rng_state = SYMBOL_HASH_MULTIPLIER;
+
+static inline uint64_t next() {
+	return nextRandom(&rng_state);
+}
+
+static inline double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
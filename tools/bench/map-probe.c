@@ -0,0 +1,264 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map-common.h"
+
+// Measures the default hash-map.h engine for each kind of key the assembler uses, and reports how far
+// entries sit from their home slots.
+// Usage: map-probe [LOOKUPS]
+// Maps of integers (with the template's default identity hash), labels (symbol ids, hashed like the
+// assembler's label map) and symbol names (hashed like the symbol table, and with djb2 as before
+// word at a time hashing) are filled to each load factor up to MAX_LOAD_FACTOR, for a small and a
+// large capacity, with sequential, random and colliding keys. Colliding keys come in groups that
+// share a hash: integers that only differ above bit 32, label ids that are multiples of a large power
+// of two, and names whose djb2 hashes are equal. Every key is looked up, and as many keys that are
+// not in the map. LOOKUPS is the number of lookups timed for each case (default 1000000).
+// Each case prints a row, then a "hist" line counting the entries at each distance from their home
+// slot, bucketed by powers of two. The format only changes along with the version in the first line.
+
+#define FORMAT_VERSION 1
+
+size_t hashDjb2(char *d, size_t len) {
+	size_t hash = 5381;
+	for (size_t i = 0; i < len; i++) {
+		hash = hash * 33 + (unsigned char)d[i];
+	}
+	return hash;
+}
+
+// Zero marks an empty slot, so keys start at 1
+typedef uint64_t Int;
+
+// Laid out like the assembler's labels
+typedef struct Label {
+	uint32_t symbol;
+	uint32_t id;
+} Label;
+
+typedef Name Djb2Name;
+
+#define DTYPE Int
+#define QTYPE Int
+#include "../hash-map.h"
+
+#undef DTYPE
+#undef QTYPE
+#undef D_HASH
+#undef Q_HASH
+#undef VALID
+#undef EQ
+#undef HASH_EQ
+#define DTYPE Label
+#define QTYPE uint32_t
+#define D_HASH(d) (symbolIdHash((d)->symbol))
+#define Q_HASH(q) (symbolIdHash(*(q)))
+#define VALID(d) ((d).symbol)
+#define EQ(e,q) ((e).symbol == *(q))
+#define HASH_EQ(stored,hash) (true)
+#include "../hash-map.h"
+
+#undef DTYPE
+#undef QTYPE
+#undef D_HASH
+#undef Q_HASH
+#undef VALID
+#undef EQ
+#undef HASH_EQ
+#define DTYPE Name
+#define QTYPE String
+#define D_HASH(d) (hashString((d)->name, (d)->name_len))
+#define Q_HASH(q) (hashString((q)->d, (q)->len))
+#define VALID(d) ((d).name)
+#define EQ(e,q) (EQUALS((*q),(e).name,(e).name_len))
+#include "../hash-map.h"
+
+#undef DTYPE
+#undef D_HASH
+#undef Q_HASH
+#define DTYPE Djb2Name
+#define D_HASH(d) (hashDjb2((d)->name, (d)->name_len))
+#define Q_HASH(q) (hashDjb2((q)->d, (q)->len))
+#include "../hash-map.h"
+
+#define SMALL_CAPACITY 0x1000
+#define LARGE_CAPACITY 0x100000
+#define NAME_LEN 0x20
+#define COLLISION_GROUP 64		// Colliding keys that share a hash
+#define COLLISION_BITS 6		// log2(COLLISION_GROUP)
+#define NUM_BUCKETS 12			// Histogram buckets: 0, 1, 2-3, 4-7, ..., and the rest
+
+double load_factors[] = {0.25, 0.5, 0.75, MAX_LOAD_FACTOR};
+
+typedef enum Distribution {
+	KEYS_SEQUENTIAL,
+	KEYS_RANDOM,
+	KEYS_COLLIDING,
+	NUM_DISTRIBUTIONS,
+} Distribution;
+
+char *distribution_names[] = {"seq", "random", "collide"};
+
+// Key i of a distribution; the keys are distinct for i below 2 * LARGE_CAPACITY
+Int intKey(Distribution dist, size_t i) {
+	switch (dist) {
+		case KEYS_SEQUENTIAL: return i + 1;
+		case KEYS_RANDOM: return (i + 1) * SYMBOL_HASH_MULTIPLIER;
+		// Groups are scattered, so each collides with itself rather than all merging into one run
+		default: return ((Int)(i % COLLISION_GROUP) << 32) | (uint32_t)((i / COLLISION_GROUP + 1) * 0x9E3779B1);
+	}
+}
+
+uint32_t labelKey(Distribution dist, size_t i) {
+	switch (dist) {
+		case KEYS_SEQUENTIAL: return i + 1;
+		case KEYS_RANDOM: return (uint32_t)((i + 1) * 0x9E3779B1);
+		default: return (uint32_t)(i + 1) << 10;
+	}
+}
+
+// Two character blocks with equal djb2 contributions, since 33 * 'a' + 'z' == 33 * 'b' + 'Y'
+char *collision_blocks[] = {"az", "bY"};
+
+void nameKey(Distribution dist, size_t i, char *d) {
+	if (dist == KEYS_SEQUENTIAL) {
+		snprintf(d, NAME_LEN, "L%zu", i);
+	}
+	else if (dist == KEYS_RANDOM) {
+		size_t len = 3 + next() % 7;
+		for (size_t j = 0; j < len; j++) {
+			d[j] = 'a' + next() % 26;
+		}
+		snprintf(d + len, NAME_LEN - len, "%zu", i);
+	}
+	else {
+		// The group number comes first, so groups' hashes differ by a multiple of a large odd number
+		size_t len = snprintf(d, NAME_LEN, "G%zu", i / COLLISION_GROUP);
+		for (size_t j = 0; j < COLLISION_BITS; j++) {
+			memcpy(d + len + 2 * j, collision_blocks[(i >> j) & 1], 2);
+		}
+		d[len + 2 * COLLISION_BITS] = '\0';
+	}
+}
+
+typedef struct Result {
+	double  insert_ns;
+	double  hit_ns;
+	double  miss_ns;
+	double  bytes_per_entry;	// Table and probe histogram, not the keys' own storage
+	double  mean_probe;
+	size_t  max_probe_length;
+	size_t  buckets[NUM_BUCKETS];
+} Result;
+
+// Sums the map's probe histogram into power of two buckets
+void bucketProbes(size_t *probe_counts, size_t len, Result *result) {
+	memset(result->buckets, 0, sizeof(result->buckets));
+	size_t total = 0, entries = 0;
+	for (size_t d = 0; d < len; d++) {
+		size_t b = d ? 64 - __builtin_clzll(d) : 0;
+		result->buckets[b < NUM_BUCKETS ? b : NUM_BUCKETS - 1] += probe_counts[d];
+		total += d * probe_counts[d];
+		entries += probe_counts[d];
+	}
+	result->mean_probe = entries ? (double)total / entries : 0;
+}
+
+/*
+ * Runs one case for map type T
+ * Param entries: 2 * n entries; the first n are inserted and the rest are the misses
+ * Param keys:    The lookup key of each entry
+ */
+#define BENCH_TYPE(T, result, entries, keys, n, lookups, capacity) { \
+	T##Map map; \
+	T##MapInit(&map); \
+	double start = now(); \
+	for (size_t i = 0; i < n; i++) { \
+		T entry = entries[i]; \
+		T##MapInsert(&map, &entry); \
+	} \
+	result.insert_ns = (now() - start) * 1e9 / n; \
+	size_t found = 0; \
+	start = now(); \
+	for (size_t i = 0; i < lookups; i++) { \
+		found += T##MapGet(&map, keys + i % n) != NULL; \
+	} \
+	result.hit_ns = (now() - start) * 1e9 / lookups; \
+	start = now(); \
+	for (size_t i = 0; i < lookups; i++) { \
+		found += T##MapGet(&map, keys + n + i % n) != NULL; \
+	} \
+	result.miss_ns = (now() - start) * 1e9 / lookups; \
+	if (found != lookups || map.num_entries != n || map.mask + 1 != capacity) { \
+		fprintf(stderr, "map-probe: " #T " map is inconsistent\n"); \
+		exit(1); \
+	} \
+	result.bytes_per_entry = ((map.mask + 1) * sizeof(T##MapEntry) + map.probe_counts_len * sizeof(size_t)) / (double)n; \
+	result.max_probe_length = map.max_probe_length; \
+	bucketProbes(map.probe_counts, map.probe_counts_len, &result); \
+	T##MapFree(&map); \
+}
+
+void printResult(char *type, Distribution dist, size_t capacity, double load, size_t n, Result *r) {
+	printf("%-6s %-7s %9zu %5.3f %8zu %10.2f %10.2f %10.2f %11.2f %10.3f %9zu\n", type, distribution_names[dist],
+	       capacity, load, n, r->insert_ns, r->hit_ns, r->miss_ns, r->bytes_per_entry, r->mean_probe,
+	       r->max_probe_length);
+	printf("hist %s %s %zu %.3f", type, distribution_names[dist], capacity, load);
+	for (size_t b = 0; b < NUM_BUCKETS; b++) {
+		printf(" %zu", r->buckets[b]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	size_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+	size_t capacities[] = {SMALL_CAPACITY, LARGE_CAPACITY};
+	printf("map-probe %d\n", FORMAT_VERSION);
+	printf("%-6s %-7s %9s %5s %8s %10s %10s %10s %11s %10s %9s\n", "type", "keys", "capacity", "load", "entries",
+	       "insert ns", "hit ns", "miss ns", "bytes/entry", "mean probe", "max probe");
+	printf("hist TYPE KEYS CAPACITY LOAD: entries at probe distance 0 1 2-3 4-7 8-15 16-31 32-63 64-127 "
+	       "128-255 256-511 512-1023 1024+\n");
+	for (size_t c = 0; c < 2; c++) {
+		size_t capacity = capacities[c];
+		for (size_t l = 0; l < sizeof(load_factors) / sizeof(double); l++) {
+			// Fills the map as far as it goes without resizing past capacity
+			size_t n = (capacity - 1) * load_factors[l];
+			Int *ints = malloc(2 * n * sizeof(Int));
+			Label *labels = malloc(2 * n * sizeof(Label));
+			uint32_t *label_keys = malloc(2 * n * sizeof(uint32_t));
+			Name *names = malloc(2 * n * sizeof(Name));
+			String *name_keys = malloc(2 * n * sizeof(String));
+			char *text = malloc(2 * n * NAME_LEN);
+			for (Distribution dist = 0; dist < NUM_DISTRIBUTIONS; dist++) {
+				for (size_t i = 0; i < 2 * n; i++) {
+					ints[i] = intKey(dist, i);
+					label_keys[i] = labelKey(dist, i);
+					labels[i] = (Label){label_keys[i], i};
+					name_keys[i].d = text + i * NAME_LEN;
+					nameKey(dist, i, name_keys[i].d);
+					name_keys[i].len = strlen(name_keys[i].d);
+					names[i] = (Name){name_keys[i].d, name_keys[i].len, i};
+				}
+				Result result;
+				BENCH_TYPE(Int, result, ints, ints, n, lookups, capacity);
+				printResult("int", dist, capacity, load_factors[l], n, &result);
+				BENCH_TYPE(Label, result, labels, label_keys, n, lookups, capacity);
+				printResult("label", dist, capacity, load_factors[l], n, &result);
+				BENCH_TYPE(Name, result, names, name_keys, n, lookups, capacity);
+				printResult("name", dist, capacity, load_factors[l], n, &result);
+				BENCH_TYPE(Djb2Name, result, names, name_keys, n, lookups, capacity);
+				printResult("djb2", dist, capacity, load_factors[l], n, &result);
+				fflush(stdout);
+			}
+			free(ints);
+			free(labels);
+			free(label_keys);
+			free(names);
+			free(name_keys);
+			free(text);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map-common.h"
+
+// Measures the concurrent hash-map.h engine at each thread count, and checks it under contention.
+// Usage: map-threads [-n KEYS] [-l LOOKUPS] [-j THREADS]
+// For each thread count, KEYS labels are inserted into a new map, split between the threads, so the
+// map resizes many times with every thread helping. Then the threads share LOOKUPS lookups of those
+// keys, and then insert KEYS more labels while each insertion is followed by MIXED_LOOKUPS lookups of
+// the first ones, which must all hit while the map resizes under them. Last, every thread inserts
+// every key of a third set with MapGetOrInsert, in a different order, and all threads must get the
+// same entry for each key. THREADS is a comma separated list (default 1,2,4,8).
+// make bench-map-threads-tsan builds it with -fsanitize=thread to check the engine's memory ordering.
+
+size_t resizes = 0;
+
+#define DTYPE Name
+#define QTYPE String
+#define D_HASH(d) (hashString((d)->name, (d)->name_len))
+#define Q_HASH(q) (hashString((q)->d, (q)->len))
+#define DELETE(d) {}
+#define EQ(e,q) (EQUALS((*q),(e).name,(e).name_len))
+#define ON_RESIZE() {__atomic_fetch_add(&resizes, 1, __ATOMIC_RELAXED);}
+#define CONCURRENT_MAP
+#include "../hash-map.h"
+
+#define MAX_LIST 0x20
+#define MAX_THREADS 0x100
+#define NAME_LEN 0x20
+#define MIXED_LOOKUPS 8		// Lookups after each insertion of the mixed phase
+
+typedef enum Phase {
+	PHASE_INSERT,
+	PHASE_GET,
+	PHASE_MIXED,
+	PHASE_SHARED,
+} Phase;
+
+typedef struct Worker {
+	pthread_t  thread;
+	size_t     index;
+	size_t     num_threads;
+	Phase      phase;
+	size_t     failures;	// Lookups that missed a key known to be in the map, or entries that disagree
+} Worker;
+
+NameMap map;
+String *names;			// 3 * num_keys labels: the inserted keys, the mixed phase's keys, the shared keys
+uint32_t *winners;		// Id of the entry each thread got for each shared key, num_keys per thread
+size_t num_keys = 1 << 20;
+size_t num_lookups = 1 << 23;
+
+size_t parseList(char *s, size_t *list) {
+	size_t n = 0;
+	for (char *p = strtok(s, ", "); p && n < MAX_LIST; p = strtok(NULL, ", ")) {
+		list[n++] = strtoull(p, NULL, 10);
+	}
+	return n;
+}
+
+void* work(void *arg) {
+	Worker *w = arg;
+	size_t begin = num_keys * w->index / w->num_threads;
+	size_t end = num_keys * (w->index + 1) / w->num_threads;
+	uint64_t rng = (w->index + 1) * SYMBOL_HASH_MULTIPLIER;
+	if (w->phase == PHASE_INSERT) {
+		for (size_t i = begin; i < end; i++) {
+			Name entry = {names[i].d, names[i].len, i};
+			NameMapInsert(&map, &entry);
+		}
+	}
+	else if (w->phase == PHASE_GET) {
+		size_t lookups = num_lookups / w->num_threads;
+		for (size_t i = 0; i < lookups; i++) {
+			size_t k = nextRandom(&rng) % num_keys;
+			Name *found = NameMapGet(&map, names + k);
+			w->failures += !found || found->id != k;
+		}
+	}
+	else if (w->phase == PHASE_MIXED) {
+		for (size_t i = num_keys + begin; i < num_keys + end; i++) {
+			Name entry = {names[i].d, names[i].len, i};
+			NameMapInsert(&map, &entry);
+			for (size_t j = 0; j < MIXED_LOOKUPS; j++) {
+				size_t k = nextRandom(&rng) % num_keys;
+				Name *found = NameMapGet(&map, names + k);
+				w->failures += !found || found->id != k;
+			}
+		}
+	}
+	else {
+		// Each thread starts at a different key and walks them all, so threads race on every key
+		for (size_t n = 0; n < num_keys; n++) {
+			size_t i = (n + begin) % num_keys;
+			String *key = names + 2 * num_keys + i;
+			Name entry = {key->d, key->len, w->index * num_keys + i};
+			winners[w->index * num_keys + i] = NameMapGetOrInsert(&map, key, &entry)->id;
+		}
+	}
+	return NULL;
+}
+
+// Runs a phase on num_threads threads, and returns its wall time, or a negative time if it failed
+double runPhase(Phase phase, size_t num_threads) {
+	Worker workers[MAX_THREADS];
+	double start = now();
+	for (size_t i = 0; i < num_threads; i++) {
+		workers[i] = (Worker){.index = i, .num_threads = num_threads, .phase = phase};
+		pthread_create(&workers[i].thread, NULL, work, workers + i);
+	}
+	size_t failures = 0;
+	for (size_t i = 0; i < num_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		failures += workers[i].failures;
+	}
+	double seconds = now() - start;
+	return failures ? -1 : seconds;
+}
+
+// Checks that every thread got the entry that ended up in the map for each shared key
+bool checkShared(size_t num_threads) {
+	for (size_t i = 0; i < num_keys; i++) {
+		Name *found = NameMapGet(&map, names + 2 * num_keys + i);
+		if (!found || found->id % num_keys != i) {
+			return false;
+		}
+		for (size_t t = 0; t < num_threads; t++) {
+			if (winners[t * num_keys + i] != found->id) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	char default_threads[] = "1,2,4,8";
+	char *threads_arg = default_threads;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-n")) num_keys = strtoull(argv[i+1], NULL, 10);
+		else if (!strcmp(argv[i], "-l")) num_lookups = strtoull(argv[i+1], NULL, 10);
+		else if (!strcmp(argv[i], "-j")) threads_arg = argv[i+1];
+		else {
+			fprintf(stderr, "Usage: %s [-n KEYS] [-l LOOKUPS] [-j THREADS]\n", argv[0]);
+			return 1;
+		}
+	}
+	size_t threads[MAX_LIST];
+	size_t num_threads = parseList(threads_arg, threads);
+	if (!num_keys) num_keys = 1;
+
+	char *text = malloc(3 * num_keys * NAME_LEN);
+	names = malloc(3 * num_keys * sizeof(String));
+	for (size_t i = 0; i < 3 * num_keys; i++) {
+		names[i].d = text + i * NAME_LEN;
+		snprintf(names[i].d, NAME_LEN, "%c%zu", "LMS"[i / num_keys], i % num_keys);
+		names[i].len = strlen(names[i].d);
+	}
+
+	printf("%7s %12s %12s %12s %12s %8s %9s\n", "threads", "insert Mop/s", "hit Mop/s", "mixed Mop/s",
+	       "shared Mop/s", "resizes", "max probe");
+	int ret = 0;
+	for (size_t j = 0; j < num_threads; j++) {
+		size_t n = threads[j];
+		if (n < 1 || n > MAX_THREADS) {
+			fprintf(stderr, "map-threads: thread counts must be between 1 and %d\n", MAX_THREADS);
+			return 1;
+		}
+		winners = malloc(n * num_keys * sizeof(uint32_t));
+		resizes = 0;
+		NameMapInit(&map);
+		double insert = runPhase(PHASE_INSERT, n);
+		bool consistent = map.num_entries == num_keys;
+		double get = runPhase(PHASE_GET, n);
+		double mixed = runPhase(PHASE_MIXED, n);
+		consistent = consistent && map.num_entries == 2 * num_keys;
+		for (size_t i = 0; i < 2 * num_keys && consistent; i++) {
+			Name *found = NameMapGet(&map, names + i);
+			consistent = found && found->id == i;
+		}
+		double shared = runPhase(PHASE_SHARED, n);
+		consistent = consistent && map.num_entries == 3 * num_keys && checkShared(n);
+		if (insert < 0 || get < 0 || mixed < 0 || shared < 0 || !consistent) {
+			fprintf(stderr, "map-threads: map is inconsistent with %zu threads\n", n);
+			ret = 1;
+		}
+		printf("%7zu %12.2f %12.2f %12.2f %12.2f %8zu %9zu\n", n, num_keys / insert / 1e6,
+		       num_lookups / n * n / get / 1e6, num_keys * (1 + MIXED_LOOKUPS) / mixed / 1e6,
+		       num_keys * n / shared / 1e6, resizes, map.max_probe_length);
+		fflush(stdout);
+		NameMapFree(&map);
+		free(winners);
+	}
+	free(text);
+	free(names);
+	return ret;
+}
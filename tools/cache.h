@@ -0,0 +1,309 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Expects String, Program, the symbol table, UNDEFINED_LABEL, FRAGMENT_JUMP and the Source reader to be defined by the includer
+
+#define CACHE_MAGIC 0x43414353	// "SCAC"
+#define CACHE_VERSION 1
+#define CACHE_HASH_SEED 0x2545F4914F6CDD1D
+
+// Identifies the encoding of one source region: the region's text, plus everything
+// outside the region that its encoding depends on
+typedef struct CacheKey {
+	uint64_t text_hash;
+	uint64_t env_hash;		// Hash of every constant definition before the region, in order
+	uint32_t text_len;
+	uint32_t mode;			// long_mode at the start of the region, plus 2 if encodings are optimized
+} CacheKey;
+
+typedef struct CacheIndexEntry {
+	CacheKey key;
+	uint64_t offset;		// Offset of the entry's program in the file
+} CacheIndexEntry;
+
+typedef struct CacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t build;			// Hash of the assembler build that wrote the file
+	uint64_t num_entries;	// Followed by num_entries CacheIndexEntries, sorted by key
+} CacheHeader;
+
+// A cache file mapped into memory
+typedef struct Cache {
+	Source           file;
+	CacheIndexEntry *index;
+	size_t           num_entries;
+} Cache;
+
+static inline uint64_t hashMix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCD;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53;
+	h ^= h >> 33;
+	return h;
+}
+
+// 64 bit hash of a byte string, eight bytes at a time
+uint64_t hashBytes(const char *d, size_t len, uint64_t seed) {
+	uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15);
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, d + i, 8);
+		h = (h ^ hashMix(w)) * 0x9E3779B97F4A7C15;
+	}
+	uint64_t w = 0;
+	memcpy(&w, d + i, len - i);
+	h = (h ^ hashMix(w)) * 0x9E3779B97F4A7C15;
+	return hashMix(h);
+}
+
+// Identifies the assembler's source, so stale encodings are never reused and identical builds share
+// a cache. The Makefile passes a hash of the sources as ASSEMBLER_SOURCE_HASH; other builds fall back
+// to the build time, which never shares a cache but still never reuses a stale one.
+static inline uint64_t cacheBuild() {
+#ifdef ASSEMBLER_SOURCE_HASH
+	uint64_t source = ASSEMBLER_SOURCE_HASH;
+	return hashBytes((const char*)&source, sizeof(source), CACHE_VERSION);
+#else
+	static const char build[] = __DATE__ " " __TIME__;
+	return hashBytes(build, sizeof(build), CACHE_VERSION);
+#endif
+}
+
+int cacheKeyCompare(const void *a, const void *b) {
+	return memcmp(a, b, sizeof(CacheKey));
+}
+
+/*
+ * Maps a cache file written by cacheSave
+ * Param c:    The cache to load
+ * Param name: The file name
+ * Returns:    true if the file exists and was written by this build; otherwise c is an empty cache
+ */
+bool cacheLoad(Cache *c, char *name) {
+	c->index = NULL;
+	c->num_entries = 0;
+	c->file.d = NULL;
+	c->file.len = 0;
+	c->file.map_len = 0;
+	Source file;
+	if (!readSource(name, &file)) {
+		return false;
+	}
+	CacheHeader *header = (CacheHeader*) file.d;
+	if (file.len < sizeof(CacheHeader) || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION
+	    || header->build != cacheBuild()
+	    || header->num_entries > (file.len - sizeof(CacheHeader)) / sizeof(CacheIndexEntry)) {
+		freeSource(&file);
+		return false;
+	}
+	c->file = file;
+	c->index = (CacheIndexEntry*) (file.d + sizeof(CacheHeader));
+	c->num_entries = header->num_entries;
+	return true;
+}
+
+static inline bool cacheTake(Cache *c, char **p, size_t size) {
+	if (*p + size > c->file.d + c->file.len) {
+		return false;
+	}
+	*p += size;
+	return true;
+}
+
+/*
+ * Loads the program cached for a region
+ * Param c:          The cache
+ * Param key:        The key of the region
+ * Param p:          Output variable set to a program allocated with programInit's layout
+ * Param first_line: Line number of the region's first line; cached line numbers are relative to it
+ * Param symbols:    Table the label names are interned in
+ * Returns:          true on a hit
+ */
+bool cacheFind(Cache *c, CacheKey *key, Program *p, size_t first_line, SymbolTable *symbols) {
+	// A new cache has no index at all
+	CacheIndexEntry *e = c->num_entries ? bsearch(key, c->index, c->num_entries, sizeof(CacheIndexEntry), cacheKeyCompare) : NULL;
+	if (!e || e->offset > c->file.len) {
+		return false;
+	}
+	char *d = c->file.d + e->offset;
+	char *counts = d;
+	if (!cacheTake(c, &d, 3 * sizeof(uint32_t))) {
+		return false;
+	}
+	uint32_t code_len, num_frags, num_labels;
+	memcpy(&code_len, counts, sizeof(uint32_t));
+	memcpy(&num_frags, counts + 4, sizeof(uint32_t));
+	memcpy(&num_labels, counts + 8, sizeof(uint32_t));
+
+	char *code = d;
+	char *frags = code + code_len;
+	char *labels = frags + (size_t)num_frags * (3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t));
+	char *names = labels + (size_t)num_labels * 4 * sizeof(uint32_t);
+	if (!cacheTake(c, &d, names - code)) {
+		return false;
+	}
+
+	memset(p, 0, sizeof(Program));
+	p->code = malloc(code_len + 1);
+	p->code_len = p->code_capacity = code_len;
+	memcpy(p->code, code, code_len);
+
+	p->num_frags = p->frag_capacity = num_frags;
+	p->frag_offset = malloc(num_frags * sizeof(uint32_t) + 1);
+	p->frag_target = malloc(num_frags * sizeof(uint32_t) + 1);
+	p->frag_line = malloc(num_frags * sizeof(uint32_t) + 1);
+	p->frag_opcode = malloc(num_frags * sizeof(uint16_t) + 1);
+	p->frag_kind = malloc(num_frags * sizeof(uint8_t) + 1);
+	memcpy(p->frag_offset, frags, num_frags * sizeof(uint32_t));
+	frags += num_frags * sizeof(uint32_t);
+	memcpy(p->frag_target, frags, num_frags * sizeof(uint32_t));
+	frags += num_frags * sizeof(uint32_t);
+	memcpy(p->frag_line, frags, num_frags * sizeof(uint32_t));
+	frags += num_frags * sizeof(uint32_t);
+	memcpy(p->frag_opcode, frags, num_frags * sizeof(uint16_t));
+	frags += num_frags * sizeof(uint16_t);
+	memcpy(p->frag_kind, frags, num_frags * sizeof(uint8_t));
+
+	p->num_labels = p->label_capacity = num_labels;
+	p->label_offset = malloc(num_labels * sizeof(uint32_t) + 1);
+	p->label_fragment = malloc(num_labels * sizeof(uint32_t) + 1);
+	p->label_line = malloc(num_labels * sizeof(uint32_t) + 1);
+	p->label_symbol = malloc(num_labels * sizeof(uint32_t) + 1);
+	memcpy(p->label_offset, labels, num_labels * sizeof(uint32_t));
+	labels += num_labels * sizeof(uint32_t);
+	memcpy(p->label_fragment, labels, num_labels * sizeof(uint32_t));
+	labels += num_labels * sizeof(uint32_t);
+	memcpy(p->label_line, labels, num_labels * sizeof(uint32_t));
+	labels += num_labels * sizeof(uint32_t);
+
+	bool ok = true;
+	for (size_t i = 0; i < num_labels && ok; i++) {
+		uint32_t len;
+		memcpy(&len, labels + i * sizeof(uint32_t), sizeof(uint32_t));
+		char *name = d;
+		ok = cacheTake(c, &d, len);
+		p->label_symbol[i] = ok ? symbolIntern(symbols, name, len) : NO_SYMBOL;
+	}
+	for (size_t i = 0; i < num_frags; i++) {
+		p->frag_line[i] += first_line;
+		ok = ok && (p->frag_kind[i] != FRAGMENT_JUMP || p->frag_target[i] < num_labels);
+	}
+	for (size_t i = 0; i < num_labels; i++) {
+		p->label_line[i] += first_line;
+	}
+	if (!ok) {
+		programFree(p);
+	}
+	return ok;
+}
+
+void cacheFree(Cache *c) {
+	if (c->file.d) {
+		freeSource(&c->file);
+	}
+}
+
+static inline void cacheWriteLines(FILE *f, uint32_t *lines, size_t n, size_t first_line) {
+	for (size_t i = 0; i < n; i++) {
+		uint32_t line = lines[i] - first_line;
+		fwrite(&line, sizeof(uint32_t), 1, f);
+	}
+}
+
+/*
+ * Writes the encoding of every region to a cache file, replacing it atomically
+ * Param name:        The file name
+ * Param keys:        The key of each region
+ * Param programs:    The program of each region
+ * Param first_lines: Line number of the first line of each region
+ * Param n:           Number of regions
+ * Param symbols:     Table holding the label names
+ * Returns:           true if the file was written
+ */
+bool cacheSave(char *name, CacheKey *keys, Program **programs, size_t *first_lines, size_t n, SymbolTable *symbols) {
+	size_t name_len = strlen(name);
+	char *tmp_name = malloc(name_len + 5);
+	memcpy(tmp_name, name, name_len);
+	memcpy(tmp_name + name_len, ".tmp", 5);
+	FILE *f = fopen(tmp_name, "w");
+	if (!f) {
+		free(tmp_name);
+		return false;
+	}
+
+	// Index entries are sorted by key; duplicate regions are stored once
+	CacheIndexEntry *index = malloc(n * sizeof(CacheIndexEntry) + 1);
+	size_t *order = malloc(n * sizeof(size_t) + 1);
+	for (size_t i = 0; i < n; i++) {
+		index[i].key = keys[i];
+		index[i].offset = i;
+	}
+	qsort(index, n, sizeof(CacheIndexEntry), cacheKeyCompare);
+	size_t num_entries = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (num_entries && !cacheKeyCompare(&index[num_entries-1].key, &index[i].key)) {
+			continue;
+		}
+		index[num_entries++] = index[i];
+	}
+
+	uint64_t offset = sizeof(CacheHeader) + num_entries * sizeof(CacheIndexEntry);
+	for (size_t i = 0; i < num_entries; i++) {
+		Program *p = programs[index[i].offset];
+		order[i] = index[i].offset;
+		index[i].offset = offset;
+		offset += 3 * sizeof(uint32_t) + p->code_len
+		        + p->num_frags * (3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t))
+		        + p->num_labels * 4 * sizeof(uint32_t);
+		for (size_t j = 0; j < p->num_labels; j++) {
+			offset += symbols->names[p->label_symbol[j]].len;
+		}
+	}
+
+	CacheHeader header;
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.build = cacheBuild();
+	header.num_entries = num_entries;
+	fwrite(&header, sizeof(CacheHeader), 1, f);
+	fwrite(index, sizeof(CacheIndexEntry), num_entries, f);
+
+	for (size_t i = 0; i < num_entries; i++) {
+		Program *p = programs[order[i]];
+		uint32_t counts[3] = {p->code_len, p->num_frags, p->num_labels};
+		fwrite(counts, sizeof(uint32_t), 3, f);
+		fwrite(p->code, 1, p->code_len, f);
+		fwrite(p->frag_offset, sizeof(uint32_t), p->num_frags, f);
+		fwrite(p->frag_target, sizeof(uint32_t), p->num_frags, f);
+		cacheWriteLines(f, p->frag_line, p->num_frags, first_lines[order[i]]);
+		fwrite(p->frag_opcode, sizeof(uint16_t), p->num_frags, f);
+		fwrite(p->frag_kind, sizeof(uint8_t), p->num_frags, f);
+		fwrite(p->label_offset, sizeof(uint32_t), p->num_labels, f);
+		fwrite(p->label_fragment, sizeof(uint32_t), p->num_labels, f);
+		cacheWriteLines(f, p->label_line, p->num_labels, first_lines[order[i]]);
+		for (size_t j = 0; j < p->num_labels; j++) {
+			uint32_t len = symbols->names[p->label_symbol[j]].len;
+			fwrite(&len, sizeof(uint32_t), 1, f);
+		}
+		for (size_t j = 0; j < p->num_labels; j++) {
+			String *label_name = symbols->names + p->label_symbol[j];
+			fwrite(label_name->d, 1, label_name->len, f);
+		}
+	}
+
+	bool ok = !ferror(f);
+	ok = !fclose(f) && ok && !rename(tmp_name, name);
+	if (!ok) {
+		remove(tmp_name);
+	}
+	free(index);
+	free(order);
+	free(tmp_name);
+	return ok;
+}
@@ -1,4 +1,7 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef DTYPE
 #define DTYPE int
@@ -17,7 +20,7 @@
 #endif
 
 #ifndef DELETE
-#define DELETE {}
+#define DELETE(d) {}
 #endif
 
 #ifndef VALID
@@ -28,6 +31,22 @@
 #define EQ(d,q) (*(q) == (d))
 #endif
 
+// Compares the hash stored with an entry to the hash of the key being looked up. GET only calls EQ
+// when this holds, so mismatched keys are rejected without comparing them. Define it as 1 for keys
+// that are cheaper to compare than their hashes.
+#ifndef HASH_EQ
+#define HASH_EQ(stored,hash) ((stored) == (hash))
+#endif
+
+// Called with the number of slots examined by each lookup or insertion
+#ifndef ON_PROBE
+#define ON_PROBE(n) {}
+#endif
+
+#ifndef ON_RESIZE
+#define ON_RESIZE() {}
+#endif
+
 #ifndef MAP_START_SIZE
 #define MAP_START_SIZE 0x40
 #define MAP_START_MASK 0x3F
@@ -59,6 +78,535 @@
 #define GET E(DTYPE,MapGet)
 #define BASIC_INSERT E(DTYPE,BasicInsert)
 #define INSERT E(DTYPE,MapInsert)
+#define ERASE E(DTYPE,MapErase)
+#define RESIZE E(DTYPE,MapResize)
+#define RESERVE E(DTYPE,MapReserve)
+#define BULK_BUILD E(DTYPE,MapBulkBuild)
+
+// Three engines sit behind the same names. The default is Robin Hood linear probing over the entries
+// themselves. Defining SWISS_MAP before including this header selects a Swiss table instead: a
+// separate array of control bytes, one per slot, holds a 7 bit fingerprint of each slot's hash, and
+// lookups compare a whole group of control bytes at once, so entries are only touched on a likely match.
+// Defining CONCURRENT_MAP selects plain linear probing that threads can share: lookups never lock or
+// wait, insertions claim slots with atomic compare and swap, and all inserting threads help resize.
+// It has no MapErase, and adds MapGetOrInsert.
+#ifdef SWISS_MAP
+
+#ifndef SWISS_GROUP_SIZE
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define SWISS_GROUP_SIZE 16		// Control bytes compared at once; MAP_START_SIZE must be at least this
+#define SWISS_EMPTY 0x80		// Control byte of an empty slot; full slots hold their fingerprint
+#define SWISS_DELETED 0xFE		// Control byte of an erased slot, which lookups probe past
+// The top bits of the hash, since the low bits already choose the slot
+#define SWISS_FINGERPRINT(hash) ((uint8_t)((hash) >> (sizeof(size_t) * 8 - 7)))
+
+// Bit i is set if control byte i of the group is byte
+__attribute__((always_inline)) static inline uint32_t swissMatch(const uint8_t *group, uint8_t byte) {
+#if defined(__x86_64__)
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+		mask |= (uint32_t)(group[i] == byte) << i;
+	}
+	return mask;
+#endif
+}
+
+// Bit i is set if slot i of the group is empty or erased; only those control bytes have the high bit set
+__attribute__((always_inline)) static inline uint32_t swissMatchFree(const uint8_t *group) {
+#if defined(__x86_64__)
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+		mask |= (uint32_t)(group[i] >> 7) << i;
+	}
+	return mask;
+#endif
+}
+#endif
+
+#define SET_CTRL E(DTYPE,MapSetCtrl)
+
+typedef struct MAP_ENTRY {
+	DTYPE   l;
+	size_t  hash;
+} MAP_ENTRY;
+
+typedef struct MAP {
+	MAP_ENTRY   *data;
+	uint8_t     *ctrl;		// A control byte per slot, then a copy of the first group so groups can be loaded across the end
+	size_t      mask;
+	size_t      num_entries;
+	size_t      grow_at;			// Load above which the next insertion resizes the map
+	size_t      num_deleted;		// Erased slots; they count towards the load until the next rehash
+	size_t      max_probe_length;	// In groups past the first; only shrinks when the table is rehashed
+} MAP;
+
+void INIT(MAP *m) {
+	m->data = calloc(MAP_START_SIZE, sizeof(MAP_ENTRY));
+	m->ctrl = malloc(MAP_START_SIZE + SWISS_GROUP_SIZE);
+	memset(m->ctrl, SWISS_EMPTY, MAP_START_SIZE + SWISS_GROUP_SIZE);
+	m->mask = MAP_START_MASK;
+	m->num_entries = 0;
+	m->grow_at = m->mask * MAX_LOAD_FACTOR;
+	m->num_deleted = 0;
+	m->max_probe_length = 0;
+}
+
+void FREE_MAP(MAP *m) {
+	for (size_t i = 0; i <= m->mask; i++) {
+		if (!(m->ctrl[i] & SWISS_EMPTY)) {
+			DELETE(m->data[i].l);
+		}
+	}
+	free(m->data);
+	free(m->ctrl);
+}
+
+static inline void SET_CTRL(MAP *map, size_t i, uint8_t byte) {
+	map->ctrl[i] = byte;
+	if (i < SWISS_GROUP_SIZE) {
+		map->ctrl[map->mask + 1 + i] = byte;
+	}
+}
+
+// Groups are probed at triangular offsets, which visits every group of a power of two sized table
+DTYPE* GET(MAP *map, QTYPE *l) {
+	size_t mask = map->mask;
+	size_t hash = Q_HASH(l);
+	uint8_t fingerprint = SWISS_FINGERPRINT(hash);
+	size_t pos = hash & mask;
+	MAP_ENTRY *d = map->data;
+	size_t probe;
+	for (probe = 0; probe <= map->max_probe_length; probe++) {
+		uint8_t *group = map->ctrl + pos;
+		for (uint32_t match = swissMatch(group, fingerprint); match; match &= match - 1) {
+			size_t i = (pos + __builtin_ctz(match)) & mask;
+			if (HASH_EQ(d[i].hash, hash) && EQ((d[i].l),(l))) {
+				ON_PROBE(probe + 1);
+				return &(d[i].l);
+			}
+		}
+		if (swissMatch(group, SWISS_EMPTY)) {
+			break;
+		}
+		pos = (pos + SWISS_GROUP_SIZE * (probe + 1)) & mask;
+	}
+	ON_PROBE(probe + 1);
+	return NULL;
+}
+
+/*
+ * Removes the entry matching l. Its slot is marked erased rather than emptied, since other keys may
+ * have probed past it; erased slots are reused by insertions and dropped when the table is rehashed.
+ * Returns: Whether the map had a matching entry
+ */
+bool ERASE(MAP *map, QTYPE *l) {
+	DTYPE *entry = GET(map, l);
+	if (!entry) {
+		return false;
+	}
+	size_t i = (MAP_ENTRY*)entry - map->data;
+	DELETE(map->data[i].l);
+	SET_CTRL(map, i, SWISS_DELETED);
+	map->num_entries--;
+	map->num_deleted++;
+	return true;
+}
+
+void BASIC_INSERT(MAP *map, DTYPE *entry, size_t hash) {
+	size_t mask = map->mask;
+	size_t pos = hash & mask;
+	for (size_t probe = 0;; probe++) {
+		uint32_t free_slots = swissMatchFree(map->ctrl + pos);
+		if (free_slots) {
+			size_t i = (pos + __builtin_ctz(free_slots)) & mask;
+			if (map->ctrl[i] == SWISS_DELETED) {
+				map->num_deleted--;
+			}
+			map->data[i].l = *entry;
+			map->data[i].hash = hash;
+			SET_CTRL(map, i, SWISS_FINGERPRINT(hash));
+			if (probe > map->max_probe_length) {
+				map->max_probe_length = probe;
+			}
+			ON_PROBE(probe + 1);
+			return;
+		}
+		pos = (pos + SWISS_GROUP_SIZE * (probe + 1)) & mask;
+	}
+}
+
+// Rehashes every entry into a table with mask + 1 slots, dropping erased slots
+void RESIZE(MAP *map, size_t mask) {
+	ON_RESIZE();
+	size_t old_mask = map->mask;
+	MAP_ENTRY *old_data = map->data;
+	uint8_t *old_ctrl = map->ctrl;
+	map->mask = mask;
+	map->grow_at = mask * MAX_LOAD_FACTOR;
+	map->data = calloc(mask + 1, sizeof(MAP_ENTRY));
+	map->ctrl = malloc(mask + 1 + SWISS_GROUP_SIZE);
+	memset(map->ctrl, SWISS_EMPTY, mask + 1 + SWISS_GROUP_SIZE);
+	map->num_deleted = 0;
+	map->max_probe_length = 0;
+	for (size_t i = 0; i <= old_mask; i++) {
+		if (!(old_ctrl[i] & SWISS_EMPTY)) {
+			BASIC_INSERT(map, &(old_data[i].l), old_data[i].hash);
+		}
+	}
+	free(old_data);
+	free(old_ctrl);
+}
+
+void INSERT(MAP *map, DTYPE *entry) {
+	if (++map->num_entries + map->num_deleted > map->grow_at) {
+		// When erased slots make up enough of the load, rehashing at the same size clears them
+		if (map->num_entries > map->grow_at * 7 / 8) {
+			RESIZE(map, (map->mask << RESIZE_SHIFT) | RESIZE_MASK);
+		}
+		else {
+			RESIZE(map, map->mask);
+		}
+	}
+	size_t hash = D_HASH(entry);
+	BASIC_INSERT(map, entry, hash);
+}
+
+// Makes room for n entries in total, so inserting up to n entries does not resize the map
+void RESERVE(MAP *map, size_t n) {
+	size_t mask = map->mask;
+	while ((size_t)(mask * MAX_LOAD_FACTOR) < n) {
+		mask = (mask << 1) | 1;
+	}
+	if (mask != map->mask || n + map->num_deleted > map->grow_at) {
+		RESIZE(map, mask);
+	}
+}
+
+#elif defined(CONCURRENT_MAP)
+
+#ifndef CONCURRENT_EMPTY
+#define CONCURRENT_EMPTY 0
+#define CONCURRENT_BUSY 1			// Claimed by an insertion that has not written the entry yet
+#define CONCURRENT_FULL 2
+#define CONCURRENT_MOVED_EMPTY 3	// Migrated while empty; later insertions went to the next table
+#define CONCURRENT_MOVED_FULL 4		// Copied to the next table; the entry here is still valid
+#define MIGRATE_CHUNK 0x400			// Slots a thread claims at a time when migrating a table
+
+static inline void concurrentPause() {
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+#endif
+
+// Plain linear probing has no Robin Hood displacement to even out its runs, which grow quickly with
+// the load, so it resizes earlier than the other engines, and also once an insertion probes past
+// CONCURRENT_MAX_PROBE slots in a table that is at least half way to its limit
+#ifndef CONCURRENT_MAX_LOAD_FACTOR
+#define CONCURRENT_MAX_LOAD_FACTOR 0.75
+#endif
+
+#ifndef CONCURRENT_MAX_PROBE
+#define CONCURRENT_MAX_PROBE 0x80
+#endif
+
+#define TABLE E(DTYPE,MapTable)
+#define NEW_TABLE E(DTYPE,MapNewTable)
+#define START_RESIZE E(DTYPE,MapStartResize)
+#define MIGRATE E(DTYPE,MapMigrate)
+#define INSERT_INTO E(DTYPE,MapInsertInto)
+#define PUT E(DTYPE,MapPut)
+#define UPDATE_MAX_PROBE E(DTYPE,MapUpdateMaxProbe)
+#define GET_OR_INSERT E(DTYPE,MapGetOrInsert)
+
+typedef struct MAP_ENTRY {
+	DTYPE    l;
+	size_t   hash;
+	uint8_t  state;		// CONCURRENT_EMPTY and so on; FULL is stored with release ordering once l and hash are written
+} MAP_ENTRY;
+
+typedef struct TABLE {
+	MAP_ENTRY     *data;
+	size_t         mask;
+	size_t         grow_at;
+	size_t         count;			// Claimed slots
+	struct TABLE  *next;			// Table the entries are moving to, or NULL
+	size_t         migrate_next;	// First slot not yet claimed by a migrating thread
+	size_t         migrated;		// Slots migrated so far
+} TABLE;
+
+typedef struct MAP {
+	TABLE   *table;				// Current table
+	TABLE   *first;				// Older tables stay allocated until FREE_MAP, since readers may still be in them
+	size_t   mask;				// Of the current table
+	size_t   num_entries;
+	size_t   max_probe_length;	// Longest insertion probe in any of the tables
+} MAP;
+
+static TABLE* NEW_TABLE(size_t mask) {
+	TABLE *t = calloc(1, sizeof(TABLE));
+	t->data = calloc(mask + 1, sizeof(MAP_ENTRY));
+	t->mask = mask;
+	t->grow_at = mask * CONCURRENT_MAX_LOAD_FACTOR;
+	return t;
+}
+
+void INIT(MAP *m) {
+	m->table = m->first = NEW_TABLE(MAP_START_MASK);
+	m->mask = MAP_START_MASK;
+	m->num_entries = 0;
+	m->max_probe_length = 0;
+}
+
+// Must not run concurrently with anything else; every entry is FULL in exactly one table by then
+void FREE_MAP(MAP *m) {
+	for (TABLE *t = m->first, *next; t; t = next) {
+		next = t->next;
+		for (size_t i = 0; i <= t->mask; i++) {
+			if (t->data[i].state == CONCURRENT_FULL) {
+				DELETE(t->data[i].l);
+			}
+		}
+		free(t->data);
+		free(t);
+	}
+}
+
+/*
+ * Looks up l without taking locks or waiting on writers, so it can run alongside insertions. A slot
+ * that is still being written is skipped; its insertion has not finished, so it may be ordered after
+ * this lookup. Entries are never moved within a table, and tables a migration copied out of are kept,
+ * so the returned entry stays valid until the map is freed. Entries must not be modified once inserted.
+ */
+DTYPE* GET(MAP *map, QTYPE *l) {
+	size_t hash = Q_HASH(l);
+	size_t distance = 0;
+	for (TABLE *t = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE); t; t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+		size_t pos = hash & t->mask;
+		for (size_t i = 0; i <= t->mask; i++, distance++) {
+			MAP_ENTRY *e = t->data + pos;
+			uint8_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+			if (state == CONCURRENT_EMPTY) {
+				ON_PROBE(distance + 1);
+				return NULL;
+			}
+			// Anything inserted after this slot was migrated is in the next table
+			if (state == CONCURRENT_MOVED_EMPTY) {
+				break;
+			}
+			if (state != CONCURRENT_BUSY && HASH_EQ(e->hash, hash) && EQ((e->l),(l))) {
+				ON_PROBE(distance + 1);
+				return &(e->l);
+			}
+			pos = (pos+1) & t->mask;
+		}
+	}
+	ON_PROBE(distance + 1);
+	return NULL;
+}
+
+// Claims a slot of t for an entry that is not in it, without checking for a matching key. Several
+// migrating threads may copy into the same table at once; each slot is claimed by a compare and swap
+// on its state byte, so every entry gets a slot of its own. Keys need no check because no insertion
+// looks for them in t until the migration into it has finished.
+static size_t INSERT_INTO(TABLE *t, DTYPE *entry, size_t hash) {
+	size_t pos = hash & t->mask;
+	for (size_t distance = 0;; distance++) {
+		uint8_t expected = CONCURRENT_EMPTY;
+		if (__atomic_compare_exchange_n(&t->data[pos].state, &expected, CONCURRENT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			t->data[pos].l = *entry;
+			t->data[pos].hash = hash;
+			__atomic_store_n(&t->data[pos].state, CONCURRENT_FULL, __ATOMIC_RELEASE);
+			__atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+			return distance;
+		}
+		pos = (pos+1) & t->mask;
+	}
+}
+
+static inline void UPDATE_MAX_PROBE(MAP *map, size_t distance) {
+	size_t longest = __atomic_load_n(&map->max_probe_length, __ATOMIC_RELAXED);
+	while (distance > longest && !__atomic_compare_exchange_n(&map->max_probe_length, &longest, distance, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Allocates the table t migrates to, unless another thread already has
+static void START_RESIZE(TABLE *t, size_t mask) {
+	if (__atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	TABLE *next = NEW_TABLE(mask);
+	TABLE *expected = NULL;
+	if (__atomic_compare_exchange_n(&t->next, &expected, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		ON_RESIZE();
+	}
+	else {
+		free(next->data);
+		free(next);
+	}
+}
+
+/*
+ * Helps move the entries of t to t->next, and returns once all of them have moved. Every thread that
+ * finds a migration under way joins in, claiming MIGRATE_CHUNK slots at a time. Each slot ends up
+ * MOVED_EMPTY or MOVED_FULL, so an insertion that reaches a migrated slot knows to retry in the next
+ * table, and nothing is inserted into the next table until every slot of t has been copied.
+ */
+static void MIGRATE(MAP *map, TABLE *t) {
+	TABLE *next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+	size_t size = t->mask + 1;
+	size_t longest = 0;
+	for (;;) {
+		size_t start = __atomic_fetch_add(&t->migrate_next, MIGRATE_CHUNK, __ATOMIC_RELAXED);
+		if (start >= size) {
+			break;
+		}
+		size_t end = start + MIGRATE_CHUNK < size ? start + MIGRATE_CHUNK : size;
+		for (size_t i = start; i < end; i++) {
+			MAP_ENTRY *e = t->data + i;
+			for (;;) {
+				uint8_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+				if (state == CONCURRENT_EMPTY) {
+					if (__atomic_compare_exchange_n(&e->state, &state, CONCURRENT_MOVED_EMPTY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+						break;
+					}
+				}
+				else if (state == CONCURRENT_FULL) {
+					size_t distance = INSERT_INTO(next, &(e->l), e->hash);
+					if (distance > longest) {
+						longest = distance;
+					}
+					__atomic_store_n(&e->state, CONCURRENT_MOVED_FULL, __ATOMIC_RELEASE);
+					break;
+				}
+				else {
+					concurrentPause();
+				}
+			}
+		}
+		__atomic_fetch_add(&t->migrated, end - start, __ATOMIC_RELEASE);
+	}
+	UPDATE_MAX_PROBE(map, longest);
+	while (__atomic_load_n(&t->migrated, __ATOMIC_ACQUIRE) < size) {
+		concurrentPause();
+	}
+	TABLE *expected = t;
+	if (__atomic_compare_exchange_n(&map->table, &expected, next, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&map->mask, next->mask, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Inserts entry, whose key is l and whose hash is hash, unless the map already has an entry matching
+ * l. A NULL l skips the check, for callers that know the key is new. Slots are claimed with a compare
+ * and swap, and an insertion that meets a claimed slot waits for its entry before comparing keys, so
+ * concurrent insertions of one key agree on a single entry, though not on which table's copy of it
+ * they return.
+ * Returns: The entry matching l, which is the inserted one if there was none
+ */
+static DTYPE* PUT(MAP *map, QTYPE *l, DTYPE *entry, size_t hash) {
+	TABLE *t = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+	for (;;) {
+		if (__atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+			MIGRATE(map, t);
+			t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		size_t pos = hash & t->mask;
+		size_t distance = 0;
+		while (distance <= t->mask) {
+			MAP_ENTRY *e = t->data + pos;
+			uint8_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+			if (state == CONCURRENT_EMPTY) {
+				if (!__atomic_compare_exchange_n(&e->state, &state, CONCURRENT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					continue;
+				}
+				e->l = *entry;
+				e->hash = hash;
+				__atomic_store_n(&e->state, CONCURRENT_FULL, __ATOMIC_RELEASE);
+				ON_PROBE(distance + 1);
+				UPDATE_MAX_PROBE(map, distance);
+				__atomic_fetch_add(&map->num_entries, 1, __ATOMIC_RELAXED);
+				size_t count = __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+				if (count > t->grow_at || (distance > CONCURRENT_MAX_PROBE && count > t->grow_at / 2)) {
+					START_RESIZE(t, (t->mask << RESIZE_SHIFT) | RESIZE_MASK);
+				}
+				return &(e->l);
+			}
+			if (state == CONCURRENT_BUSY) {
+				concurrentPause();
+				continue;
+			}
+			if (state == CONCURRENT_MOVED_EMPTY) {
+				break;
+			}
+			if (l && HASH_EQ(e->hash, hash) && EQ((e->l),(l))) {
+				ON_PROBE(distance + 1);
+				return &(e->l);
+			}
+			pos = (pos+1) & t->mask;
+			distance++;
+		}
+		// Either a migration reached this probe sequence, or concurrent insertions filled the table
+		START_RESIZE(t, (t->mask << RESIZE_SHIFT) | RESIZE_MASK);
+	}
+}
+
+/*
+ * Finds the entry matching l, or inserts entry, which must have the same key, if there is none.
+ * Concurrent calls for one key agree on the contents of a single entry, but not on its address: a
+ * call that runs during a resize may return the copy in the table being migrated from. That copy
+ * stays readable until MapFree and is never modified, but callers must not keep the pointer across a
+ * resize or compare it with others to tell entries apart; they should read what they need from it.
+ */
+DTYPE* GET_OR_INSERT(MAP *map, QTYPE *l, DTYPE *entry) {
+	return PUT(map, l, entry, Q_HASH(l));
+}
+
+// Inserts an entry whose key is not in the map, like the other engines; safe alongside other insertions
+void INSERT(MAP *map, DTYPE *entry) {
+	PUT(map, NULL, entry, D_HASH(entry));
+}
+
+// For building a map before it is shared
+void BASIC_INSERT(MAP *map, DTYPE *entry, size_t hash) {
+	size_t distance = INSERT_INTO(map->table, entry, hash);
+	ON_PROBE(distance + 1);
+	UPDATE_MAX_PROBE(map, distance);
+}
+
+// Moves every entry into a table with mask + 1 slots; other threads that are inserting help with the move
+void RESIZE(MAP *map, size_t mask) {
+	TABLE *t = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+	START_RESIZE(t, mask);
+	MIGRATE(map, t);
+}
+
+// Makes room for n entries in total, so inserting up to n entries does not resize the map
+void RESERVE(MAP *map, size_t n) {
+	size_t mask = map->mask;
+	while ((size_t)(mask * CONCURRENT_MAX_LOAD_FACTOR) < n) {
+		mask = (mask << 1) | 1;
+	}
+	if (mask != map->mask) {
+		RESIZE(map, mask);
+	}
+}
+
+#else
+
+#ifndef PROBE_COUNTS_START_SIZE
+#define PROBE_COUNTS_START_SIZE 0x10
+#endif
+
+#define COUNT_PROBE E(DTYPE,MapCountProbe)
 
 typedef struct MAP_ENTRY {
 	DTYPE   l;
@@ -69,14 +617,20 @@ typedef struct MAP {
 	MAP_ENTRY   *data;
 	size_t      mask;
 	size_t      num_entries;
+	size_t      grow_at;			// Number of entries above which the next insertion resizes the map
 	size_t      max_probe_length;
+	size_t      *probe_counts;		// Number of entries at each distance from their home slot
+	size_t      probe_counts_len;
 } MAP;
 
 void INIT(MAP *m) {
 	m->data = calloc(MAP_START_SIZE, sizeof(MAP_ENTRY));
 	m->mask = MAP_START_MASK;
 	m->num_entries = 0;
+	m->grow_at = m->mask * MAX_LOAD_FACTOR;
 	m->max_probe_length = 0;
+	m->probe_counts_len = PROBE_COUNTS_START_SIZE;
+	m->probe_counts = calloc(m->probe_counts_len, sizeof(size_t));
 }
 
 void FREE_MAP(MAP *m) {
@@ -84,19 +638,40 @@ void FREE_MAP(MAP *m) {
 		DELETE(m->data[i].l);
 	}
 	free(m->data);
+	free(m->probe_counts);
+}
+
+// Records an entry placed at distance from its home slot
+static inline void COUNT_PROBE(MAP *map, size_t distance) {
+	if (distance >= map->probe_counts_len) {
+		size_t old_len = map->probe_counts_len;
+		while (distance >= map->probe_counts_len) {
+			map->probe_counts_len <<= 1;
+		}
+		map->probe_counts = realloc(map->probe_counts, map->probe_counts_len * sizeof(size_t));
+		memset(map->probe_counts + old_len, 0, (map->probe_counts_len - old_len) * sizeof(size_t));
+	}
+	map->probe_counts[distance]++;
+	if (distance > map->max_probe_length) {
+		map->max_probe_length = distance;
+	}
 }
 
 DTYPE* GET(MAP *map, QTYPE *l) {
 	size_t mask = map->mask;
-	size_t pos = Q_HASH(l) & mask;
+	size_t hash = Q_HASH(l);
+	size_t pos = hash & mask;
 	MAP_ENTRY *d = map->data;
 	size_t max_dist = map->max_probe_length;
-	for (size_t distance = 0; VALID(d[pos].l) && distance <= max_dist; distance++) {
-		if (EQ((d[pos].l),(l))) {
+	size_t distance;
+	for (distance = 0; VALID(d[pos].l) && distance <= max_dist; distance++) {
+		if (HASH_EQ(d[pos].hash, hash) && EQ((d[pos].l),(l))) {
+			ON_PROBE(distance + 1);
 			return &(d[pos].l);
 		}
 		pos = (pos+1) & mask;
 	}
+	ON_PROBE(distance + 1);
 	return NULL;
 }
 
@@ -108,13 +683,14 @@ void BASIC_INSERT(MAP *map, DTYPE *entry, size_t hash) {
 		if (!VALID(d[pos].l)) {
 			d[pos].l = *entry;
 			d[pos].hash = hash;
-			if (distance > map->max_probe_length) {
-				map->max_probe_length = distance;
-			}
+			COUNT_PROBE(map, distance);
+			ON_PROBE(distance + 1);
 			return;
 		}
 		size_t prev_dist = (pos - d[pos].hash) & mask;
 		if (prev_dist < distance) {
+			COUNT_PROBE(map, distance);
+			map->probe_counts[prev_dist]--;
 			DTYPE tmp = *entry;
 			*entry = d[pos].l;
 			d[pos].l = tmp;
@@ -127,22 +703,126 @@ void BASIC_INSERT(MAP *map, DTYPE *entry, size_t hash) {
 	}
 }
 
-void INSERT(MAP *map, DTYPE *entry) {
-	map->num_entries++;
-	size_t mask = map->mask;
-	if ((double)map->num_entries / mask > MAX_LOAD_FACTOR) {
-		size_t old_mask = map->mask;
-		map->mask = (old_mask << RESIZE_SHIFT) | RESIZE_MASK;
-		MAP_ENTRY *old_data = map->data;
-		map->data = calloc(map->mask+1, sizeof(MAP_ENTRY));
-		map->max_probe_length = 0;
-		for (size_t i = 0; i <= old_mask; i++) {
-			if (old_data[i].l.name) {
-				BASIC_INSERT(map, &(old_data[i].l), old_data[i].hash);
-			}
+// Rehashes every entry into a table with mask + 1 slots
+void RESIZE(MAP *map, size_t mask) {
+	ON_RESIZE();
+	size_t old_mask = map->mask;
+	MAP_ENTRY *old_data = map->data;
+	map->mask = mask;
+	map->grow_at = mask * MAX_LOAD_FACTOR;
+	map->data = calloc(mask + 1, sizeof(MAP_ENTRY));
+	map->max_probe_length = 0;
+	memset(map->probe_counts, 0, map->probe_counts_len * sizeof(size_t));
+	for (size_t i = 0; i <= old_mask; i++) {
+		if (VALID(old_data[i].l)) {
+			BASIC_INSERT(map, &(old_data[i].l), old_data[i].hash);
 		}
-		free(old_data);
+	}
+	free(old_data);
+}
+
+void INSERT(MAP *map, DTYPE *entry) {
+	if (++map->num_entries > map->grow_at) {
+		RESIZE(map, (map->mask << RESIZE_SHIFT) | RESIZE_MASK);
 	}
 	size_t hash = D_HASH(entry);
 	BASIC_INSERT(map, entry, hash);
 }
+
+// Makes room for n entries in total, so inserting up to n entries does not resize the map
+void RESERVE(MAP *map, size_t n) {
+	size_t mask = map->mask;
+	while ((size_t)(mask * MAX_LOAD_FACTOR) < n) {
+		mask = (mask << 1) | 1;
+	}
+	if (mask != map->mask) {
+		RESIZE(map, mask);
+	}
+}
+
+/*
+ * Removes the entry matching l. The entries after it that are not in their home slot shift back by
+ * one, so no tombstones are left and probe lengths stay as if the entry had never been inserted.
+ * Returns: Whether the map had a matching entry
+ */
+bool ERASE(MAP *map, QTYPE *l) {
+	size_t mask = map->mask;
+	size_t hash = Q_HASH(l);
+	size_t pos = hash & mask;
+	MAP_ENTRY *d = map->data;
+	size_t distance;
+	for (distance = 0;; distance++) {
+		if (!VALID(d[pos].l) || distance > map->max_probe_length) {
+			ON_PROBE(distance + 1);
+			return false;
+		}
+		if (HASH_EQ(d[pos].hash, hash) && EQ((d[pos].l),(l))) {
+			break;
+		}
+		pos = (pos+1) & mask;
+	}
+	ON_PROBE(distance + 1);
+	DELETE(d[pos].l);
+	map->probe_counts[distance]--;
+	for (size_t next = (pos+1) & mask; VALID(d[next].l); next = (next+1) & mask) {
+		size_t next_dist = (next - d[next].hash) & mask;
+		if (!next_dist) {
+			break;
+		}
+		map->probe_counts[next_dist]--;
+		map->probe_counts[next_dist - 1]++;
+		d[pos] = d[next];
+		pos = next;
+	}
+	memset(d + pos, 0, sizeof(MAP_ENTRY));
+	map->num_entries--;
+	while (map->max_probe_length && !map->probe_counts[map->max_probe_length]) {
+		map->max_probe_length--;
+	}
+	return true;
+}
+
+#endif
+
+/*
+ * Inserts a batch of entries, resizing the map at most once
+ * Param map:     The map
+ * Param entries: The entries; like INSERT, insertion may swap their contents with entries it displaces
+ * Param n:       Number of entries
+ * Param sorted:  Insert in order of home slot (by a counting sort), so the table is written front to back
+ */
+void BULK_BUILD(MAP *map, DTYPE *entries, size_t n, bool sorted) {
+	RESERVE(map, map->num_entries + n);
+	map->num_entries += n;
+	if (!sorted) {
+		for (size_t i = 0; i < n; i++) {
+			BASIC_INSERT(map, entries + i, D_HASH(entries + i));
+		}
+		return;
+	}
+	// About one bucket per entry; the order within a bucket does not matter
+	size_t shift = 0;
+	while (((map->mask + 1) >> shift) > n && (map->mask >> shift)) {
+		shift++;
+	}
+	size_t num_buckets = (map->mask >> shift) + 1;
+	size_t *starts = calloc(num_buckets + 1, sizeof(size_t));
+	size_t *hashes = malloc(n * sizeof(size_t) + 1);
+	size_t *order = malloc(n * sizeof(size_t) + 1);
+	for (size_t i = 0; i < n; i++) {
+		hashes[i] = D_HASH(entries + i);
+		starts[((hashes[i] & map->mask) >> shift) + 1]++;
+	}
+	for (size_t b = 0; b < num_buckets; b++) {
+		starts[b + 1] += starts[b];
+	}
+	for (size_t i = 0; i < n; i++) {
+		order[starts[(hashes[i] & map->mask) >> shift]++] = i;
+	}
+	for (size_t i = 0; i < n; i++) {
+		BASIC_INSERT(map, entries + order[i], hashes[order[i]]);
+	}
+	free(starts);
+	free(hashes);
+	free(order);
+}
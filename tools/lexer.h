@@ -0,0 +1,362 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Expects String and the symbol table (symbols.h) to be defined by the includer
+
+#define TOKEN_END 0			// End of the source
+#define TOKEN_NEWLINE 1		// End of a line that contained at least one token
+#define TOKEN_IDENTIFIER 2
+#define TOKEN_NUMBER 3
+#define TOKEN_COMMA 4
+#define TOKEN_COLON 5
+#define TOKEN_LBRACKET 6
+#define TOKEN_RBRACKET 7
+#define TOKEN_OTHER 8		// Any other single character
+
+// Character classes used by the lexer
+#define CHAR_OTHER 0
+#define CHAR_SPACE 1
+#define CHAR_NEWLINE 2
+#define CHAR_COMMENT 3
+#define CHAR_DIGIT 4
+#define CHAR_ALPHA 5
+#define CHAR_SIGN 6
+#define CHAR_PUNCT 7
+
+typedef struct Token {
+	String   s;		// Text of the token, pointing into the source
+	uint32_t line;	// Line number of the token
+	uint32_t symbol;	// Interned id of an identifier, or NO_SYMBOL
+	uint8_t  type;	// TOKEN_IDENTIFIER, TOKEN_NUMBER, ...
+} Token;
+
+typedef struct TokenStream {
+	Token  *d;
+	size_t  len;
+	size_t  capacity;
+} TokenStream;
+
+uint8_t char_class[256] = {
+	[' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\r'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE,
+	['\n'] = CHAR_NEWLINE,
+	[';'] = CHAR_COMMENT,
+	['0' ... '9'] = CHAR_DIGIT,
+	['a' ... 'z'] = CHAR_ALPHA, ['A' ... 'Z'] = CHAR_ALPHA, ['_'] = CHAR_ALPHA,
+	['-'] = CHAR_SIGN, ['+'] = CHAR_SIGN,
+	[','] = CHAR_PUNCT, [':'] = CHAR_PUNCT, ['['] = CHAR_PUNCT, [']'] = CHAR_PUNCT,
+};
+
+static inline bool isIdentifierChar(char c) {
+	uint8_t class = char_class[(uint8_t)c];
+	return class == CHAR_ALPHA || class == CHAR_DIGIT;
+}
+
+/*
+ * Kernels that find the end of a run of characters of one kind. Each returns the first character
+ * at or after c that ends the run, or end if the run reaches it. The vector kernels read whole
+ * aligned blocks, which may extend past end but never past the page holding end's terminator.
+ */
+typedef char* (*LexScan)(char *c, char *end);
+
+typedef struct LexKernels {
+	const char *name;
+	LexScan     space;		// Skips blanks other than newlines
+	LexScan     identifier;	// Skips letters, digits and underscores
+	LexScan     comment;	// Skips to the end of the line
+} LexKernels;
+
+char* scalarSpace(char *c, char *end) {
+	while (c < end && char_class[(uint8_t)*c] == CHAR_SPACE) c++;
+	return c;
+}
+
+char* scalarIdentifier(char *c, char *end) {
+	while (c < end && isIdentifierChar(*c)) c++;
+	return c;
+}
+
+char* scalarComment(char *c, char *end) {
+	while (c < end && *c != '\n') c++;
+	return c;
+}
+
+#if defined(__x86_64__)
+
+// Masks of the bytes that end a run, one bit per byte of a block
+__attribute__((always_inline)) static inline uint32_t sse2SpaceStops(__m128i v) {
+	__m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+	                             _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+	                                           _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1))));
+	space = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), space);
+	return ~_mm_movemask_epi8(space) & 0xFFFF;
+}
+
+__attribute__((always_inline)) static inline uint32_t sse2IdentifierStops(__m128i v) {
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+	                              _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+	                              _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+	return ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under)) & 0xFFFF;
+}
+
+__attribute__((always_inline)) static inline uint32_t sse2CommentStops(__m128i v) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline uint32_t avx2SpaceStops(__m256i v) {
+	__m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+	                                _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+	                                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v)));
+	space = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), space);
+	return ~(uint32_t)_mm256_movemask_epi8(space);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline uint32_t avx2IdentifierStops(__m256i v) {
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+	                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+	__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+	                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	__m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+	return ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), under));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline uint32_t avx2CommentStops(__m256i v) {
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+
+/*
+ * Defines a kernel that scans aligned blocks of width bytes for the first stop. Bytes of the first
+ * block before c are masked off, so the loads never cross into a page that c and end do not touch.
+ * The target attribute lets each kernel use its instruction set while the rest of the file is built
+ * for the baseline, and dispatch picks one at run time.
+ */
+#define LEX_SCAN(name, isa, vector, width, load, stops) \
+	__attribute__((target(isa))) \
+	char* name(char *c, char *end) { \
+		char *block = (char*)((uintptr_t)c & ~(uintptr_t)(width - 1)); \
+		uint32_t mask = stops(load((vector*)block)) & (~0u << (c - block)); \
+		while (!mask) { \
+			block += width; \
+			if (block >= end) { \
+				return end; \
+			} \
+			mask = stops(load((vector*)block)); \
+		} \
+		char *stop = block + __builtin_ctz(mask); \
+		return stop < end ? stop : end; \
+	}
+
+LEX_SCAN(sse2Space, "sse2", __m128i, 16, _mm_load_si128, sse2SpaceStops)
+LEX_SCAN(sse2Identifier, "sse2", __m128i, 16, _mm_load_si128, sse2IdentifierStops)
+LEX_SCAN(sse2Comment, "sse2", __m128i, 16, _mm_load_si128, sse2CommentStops)
+LEX_SCAN(avx2Space, "avx2", __m256i, 32, _mm256_load_si256, avx2SpaceStops)
+LEX_SCAN(avx2Identifier, "avx2", __m256i, 32, _mm256_load_si256, avx2IdentifierStops)
+LEX_SCAN(avx2Comment, "avx2", __m256i, 32, _mm256_load_si256, avx2CommentStops)
+
+#endif
+
+LexKernels lex_kernels[] = {
+#if defined(__x86_64__)
+	{"avx2", avx2Space, avx2Identifier, avx2Comment},
+	{"sse2", sse2Space, sse2Identifier, sse2Comment},
+#endif
+	{"scalar", scalarSpace, scalarIdentifier, scalarComment},
+};
+
+LexKernels *lexer = lex_kernels + sizeof(lex_kernels) / sizeof(LexKernels) - 1;
+
+#define LEX_SHORT_RUN 8	// Runs up to this long are scanned inline; only longer ones call a kernel
+
+static inline char* skipSpace(char *c, char *end) {
+	return char_class[(uint8_t)*c] == CHAR_SPACE ? lexer->space(c, end) : c;
+}
+
+static inline char* skipIdentifier(char *c, char *end) {
+	char *short_end = end - c > LEX_SHORT_RUN ? c + LEX_SHORT_RUN : end;
+	while (c < short_end && isIdentifierChar(*c)) c++;
+	return c < short_end ? c : lexer->identifier(c, end);
+}
+
+/*
+ * Chooses the kernels used by lex; call before lexing on any thread
+ * Param name: "scalar", "sse2", "avx2", or NULL for the fastest the CPU supports
+ * Returns:    false if the kernels are unknown or not supported by the CPU
+ */
+bool lexSelect(const char *name) {
+	for (size_t i = 0; i < sizeof(lex_kernels) / sizeof(LexKernels); i++) {
+		LexKernels *k = lex_kernels + i;
+#if defined(__x86_64__)
+		if (k->identifier == avx2Identifier && !__builtin_cpu_supports("avx2")) {
+			continue;
+		}
+#endif
+		if (!name || !strcmp(name, k->name)) {
+			lexer = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline Token* pushToken(TokenStream *tokens, char *d, size_t len, uint32_t line, uint8_t type) {
+	if (tokens->len == tokens->capacity) {
+		tokens->capacity <<= 1;
+		tokens->d = realloc(tokens->d, tokens->capacity * sizeof(Token));
+	}
+	Token *t = tokens->d + tokens->len++;
+	t->s.d = d;
+	t->s.len = len;
+	t->line = line;
+	t->symbol = NO_SYMBOL;
+	t->type = type;
+	return t;
+}
+
+/*
+ * Splits source text into tokens in a single pass, skipping whitespace and ; comments
+ * Param d:          The text to lex (must be null terminated)
+ * Param len:        Length of the text
+ * Param first_line: Line number of the first line of the text
+ * Param tokens:     Output stream; every line with tokens ends in TOKEN_NEWLINE and the stream ends in TOKEN_END
+ * Param symbols:    Table the identifiers are interned in
+ */
+void lex(char *d, size_t len, uint32_t first_line, TokenStream *tokens, SymbolTable *symbols) {
+	tokens->len = 0;
+	tokens->capacity = (len >> 2) + 0x10;
+	tokens->d = malloc(tokens->capacity * sizeof(Token));
+	uint32_t line = first_line;
+	size_t line_start = 0;
+	char *end = d + len;
+	for (char *c = d; c < end;) {
+		switch (char_class[(uint8_t)*c]) {
+			case CHAR_SPACE: {
+				c = skipSpace(c + 1, end);
+				break;
+			}
+			case CHAR_COMMENT: {
+				c = lexer->comment(c + 1, end);
+				break;
+			}
+			case CHAR_NEWLINE: {
+				if (tokens->len > line_start) {
+					pushToken(tokens, c, 1, line, TOKEN_NEWLINE);
+					line_start = tokens->len;
+				}
+				line++;
+				c++;
+				break;
+			}
+			case CHAR_SIGN:
+				if (char_class[(uint8_t)c[1]] != CHAR_DIGIT) {
+					pushToken(tokens, c++, 1, line, TOKEN_OTHER);
+					break;
+				}
+				// A sign followed by a digit starts a number
+				/* fall through */
+			case CHAR_DIGIT: {
+				char *start = c;
+				c = skipIdentifier(c + 1, end);
+				pushToken(tokens, start, c - start, line, TOKEN_NUMBER);
+				break;
+			}
+			case CHAR_ALPHA: {
+				char *start = c;
+				c = skipIdentifier(c + 1, end);
+				pushToken(tokens, start, c - start, line, TOKEN_IDENTIFIER)->symbol = symbolIntern(symbols, start, c - start);
+				break;
+			}
+			case CHAR_PUNCT: {
+				uint8_t type = *c == ',' ? TOKEN_COMMA
+				             : *c == ':' ? TOKEN_COLON
+				             : *c == '[' ? TOKEN_LBRACKET
+				             : TOKEN_RBRACKET;
+				pushToken(tokens, c++, 1, line, type);
+				break;
+			}
+			default: {
+				pushToken(tokens, c++, 1, line, TOKEN_OTHER);
+			}
+		}
+	}
+	if (tokens->len > line_start) {
+		pushToken(tokens, end, 0, line, TOKEN_NEWLINE);
+	}
+	pushToken(tokens, end, 0, line, TOKEN_END);
+}
+
+void freeTokens(TokenStream *tokens) {
+	free(tokens->d);
+}
+
+// Value of a digit in any base up to 16, or 0x10 if c is not a digit
+static inline uint8_t digitValue(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : 0x10;
+}
+
+/*
+ * Parses the text of a number token: decimal, 0x hex, 0b binary or leading 0 octal, with an optional sign
+ * Param s:   The text of the token
+ * Param val: Output variable set to the value; positive values above INT64_MAX keep their 64 bit pattern
+ * Returns:   false if the text contains a digit outside its base or the value does not fit in 64 bits
+ */
+bool parseNumber(String *s, int64_t *val) {
+	char *c = s->d;
+	char *end = s->d + s->len;
+	bool negative = c < end && *c == '-';
+	if (c < end && (*c == '-' || *c == '+')) {
+		c++;
+	}
+	uint64_t base = 10;
+	if (end - c > 2 && c[0] == '0' && (c[1] | 0x20) == 'x') {
+		base = 16;
+		c += 2;
+	}
+	else if (end - c > 2 && c[0] == '0' && (c[1] | 0x20) == 'b') {
+		base = 2;
+		c += 2;
+	}
+	else if (end - c > 1 && c[0] == '0') {
+		base = 8;
+		c++;
+	}
+	if (c == end) {
+		return false;
+	}
+	uint64_t v = 0;
+	if (base == 10) {
+		// Up to 19 decimal digits cannot overflow
+		for (char *safe_end = end - c > 19 ? c + 19 : end; c < safe_end; c++) {
+			uint8_t d = (uint8_t)(*c - '0');
+			if (d > 9) {
+				return false;
+			}
+			v = v * 10 + d;
+		}
+	}
+	for (; c < end; c++) {
+		uint64_t d = digitValue(*c);
+		if (d >= base || __builtin_mul_overflow(v, base, &v) || __builtin_add_overflow(v, d, &v)) {
+			return false;
+		}
+	}
+	if (negative) {
+		if (v > (uint64_t)INT64_MAX + 1) {
+			return false;
+		}
+		v = -v;
+	}
+	*val = (int64_t)v;
+	return true;
+}
@@ -0,0 +1,65 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// An output file of known size, written in place through a shared mapping when possible
+typedef struct Output {
+	char   *d;			// Where to write the file's contents
+	size_t  len;
+	int     fd;
+	bool    mapped;		// d maps the file; otherwise d is a buffer written out by closeOutput
+} Output;
+
+/*
+ * Creates or truncates a file and gives memory to write its contents into
+ * Param name: The file name
+ * Param len:  The final size of the file
+ * Param out:  Output variable that will be set to the open file
+ * Returns:    true if the file was opened
+ */
+bool openOutput(char *name, size_t len, Output *out) {
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		return false;
+	}
+	out->fd = fd;
+	out->len = len;
+	out->mapped = false;
+
+	// Devices and pipes cannot be mapped; fall back to a single buffer for them
+	struct stat info;
+	if (len && !fstat(fd, &info) && S_ISREG(info.st_mode) && !ftruncate(fd, len)) {
+		out->d = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		out->mapped = out->d != MAP_FAILED;
+	}
+	if (!out->mapped) {
+		out->d = malloc(len + 1);
+	}
+	return true;
+}
+
+/*
+ * Finishes writing an output file and closes it
+ * Returns: true if the whole file was written
+ */
+bool closeOutput(Output *out) {
+	bool ok = true;
+	if (out->mapped) {
+		ok = !munmap(out->d, out->len);
+	}
+	else {
+		for (size_t written = 0; written < out->len;) {
+			ssize_t n = write(out->fd, out->d + written, out->len - written);
+			if (n <= 0) {
+				ok = false;
+				break;
+			}
+			written += n;
+		}
+		free(out->d);
+	}
+	return !close(out->fd) && ok;
+}
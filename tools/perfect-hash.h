@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keys are names of at most PERFECT_HASH_KEY_LEN characters packed little endian
+// into a single integer, so verifying a hit is one integer compare
+#define PERFECT_HASH_KEY_LEN 8
+#define PERFECT_HASH_MIN_BITS 4
+#define PERFECT_HASH_MAX_BITS 16
+#define PERFECT_HASH_TRIES 0x100
+#define PERFECT_HASH_SEED 0x9E3779B97F4A7C15
+#define PERFECT_HASH_EMPTY 0
+
+typedef struct PerfectHash {
+	uint64_t  multiplier;	// Multiplier that maps every key to a distinct slot
+	uint8_t   shift;		// 64 - log2(number of slots)
+	uint64_t *keys;			// Packed key stored in each slot; PERFECT_HASH_EMPTY for unused slots
+	uint16_t *values;		// Index into the caller's table for each slot
+} PerfectHash;
+
+/*
+ * Packs a short name into an integer key
+ * Param d:   characters of the name
+ * Param len: number of characters in the name
+ * Returns:   the packed key, or PERFECT_HASH_EMPTY if the name is empty or too long to be a key
+ */
+static inline uint64_t packKey(const char *d, size_t len) {
+	if (len - 1 >= PERFECT_HASH_KEY_LEN) {
+		return PERFECT_HASH_EMPTY;
+	}
+	uint64_t key = 0;
+	for (size_t i = 0; i < len; i++) {
+		key |= (uint64_t)(uint8_t)d[i] << (i << 3);
+	}
+	return key;
+}
+
+static inline size_t perfectHashSlot(PerfectHash *h, uint64_t key) {
+	return (key * h->multiplier) >> h->shift;
+}
+
+/*
+ * Searches for a multiplier that sends every key to its own slot
+ * Param h:    the table to build
+ * Param keys: packed keys; keys[i] is looked up as value i
+ * Param n:    number of keys
+ * Returns:    true if a collision free table was found
+ */
+bool perfectHashBuild(PerfectHash *h, const uint64_t *keys, size_t n) {
+	uint8_t bits = PERFECT_HASH_MIN_BITS;
+	while (((size_t)1 << bits) < n << 1) bits++;
+	for (; bits <= PERFECT_HASH_MAX_BITS; bits++) {
+		size_t size = (size_t)1 << bits;
+		h->keys = calloc(size, sizeof(uint64_t));
+		h->values = calloc(size, sizeof(uint16_t));
+		h->shift = 64 - bits;
+		h->multiplier = PERFECT_HASH_SEED;
+		for (size_t try = 0; try < PERFECT_HASH_TRIES; try++) {
+			size_t i;
+			for (i = 0; i < n; i++) {
+				size_t slot = perfectHashSlot(h, keys[i]);
+				if (h->keys[slot] != PERFECT_HASH_EMPTY) {
+					break;
+				}
+				h->keys[slot] = keys[i];
+				h->values[slot] = i;
+			}
+			if (i == n) {
+				return true;
+			}
+			memset(h->keys, 0, size * sizeof(uint64_t));
+			h->multiplier += PERFECT_HASH_SEED << 1;
+		}
+		free(h->keys);
+		free(h->values);
+	}
+	h->keys = NULL;
+	h->values = NULL;
+	return false;
+}
+
+/*
+ * Looks up a packed key
+ * Returns: the index the key was built with, or -1 if the key is not in the table
+ */
+static inline int32_t perfectHashFind(PerfectHash *h, uint64_t key) {
+	size_t slot = perfectHashSlot(h, key);
+	return h->keys[slot] == key && key != PERFECT_HASH_EMPTY ? h->values[slot] : -1;
+}
+
+void perfectHashFree(PerfectHash *h) {
+	free(h->keys);
+	free(h->values);
+}
@@ -0,0 +1,110 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SOURCE_CHUNK_SIZE 0x10000
+
+// The full text of an input file, always followed by a null byte
+typedef struct Source {
+	char   *d;			// Start of the text
+	size_t  len;		// Length of the text, not counting the terminating null
+	size_t  map_len;	// Length of the mapping, or 0 if d was allocated with malloc
+} Source;
+
+/*
+ * Maps a regular file into memory, reserving at least one zero byte past its end
+ * Param fd:   The open file
+ * Param len:  The size of the file
+ * Param src:  Output variable that will be set to the mapped text
+ * Returns:    true if the file was mapped
+ */
+bool mapSource(int fd, size_t len, Source *src) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t map_len = (len + page) & ~(page - 1);
+
+	// Reserve zero pages covering the file and its terminator, then map the file over them
+	char *d = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (d == MAP_FAILED) {
+		return false;
+	}
+	if (mmap(d, len, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED) {
+		munmap(d, map_len);
+		return false;
+	}
+	madvise(d, len, MADV_SEQUENTIAL);
+	src->d = d;
+	src->len = len;
+	src->map_len = map_len;
+	return true;
+}
+
+/*
+ * Reads a stream that cannot be mapped (a pipe, terminal or empty file) in fixed size chunks
+ * Param fd:  The open file
+ * Param src: Output variable that will be set to the text read
+ * Returns:   true if the whole stream was read
+ */
+bool readSourceChunks(int fd, Source *src) {
+	size_t capacity = SOURCE_CHUNK_SIZE;
+	size_t len = 0;
+	char *d = malloc(capacity);
+	for (;;) {
+		if (capacity - len < SOURCE_CHUNK_SIZE + 1) {
+			capacity <<= 1;
+			d = realloc(d, capacity);
+		}
+		ssize_t n = read(fd, d + len, SOURCE_CHUNK_SIZE);
+		if (n == 0) {
+			break;
+		}
+		else if (n < 0) {
+			free(d);
+			return false;
+		}
+		len += n;
+	}
+	d[len] = '\0';
+	src->d = d;
+	src->len = len;
+	src->map_len = 0;
+	return true;
+}
+
+/*
+ * Loads the full text of an input file
+ * Param name: The file name, or "-" for standard input
+ * Param src:  Output variable that will be set to the file's text
+ * Returns:    true if the file was read
+ */
+bool readSource(char *name, Source *src) {
+	bool from_stdin = !strcmp(name, "-");
+	int fd = from_stdin ? STDIN_FILENO : open(name, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	bool ok = false;
+	if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+		ok = mapSource(fd, info.st_size, src);
+	}
+	if (!ok) {
+		ok = readSourceChunks(fd, src);
+	}
+	if (!from_stdin) {
+		close(fd);
+	}
+	return ok;
+}
+
+void freeSource(Source *src) {
+	if (src->map_len) {
+		munmap(src->d, src->map_len);
+	}
+	else {
+		free(src->d);
+	}
+}
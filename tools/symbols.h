@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Expects String, EQUALS, hashString and the Arena to be defined by the includer, along with any
+// ON_PROBE and ON_RESIZE hooks for the symbol map
+
+#define SYMBOL_START_SIZE 0x100
+#define NO_SYMBOL 0		// Symbol id of every token that is not an identifier
+
+typedef struct Symbol {
+	char     *name;
+	size_t    name_len;
+	uint32_t  id;
+} Symbol;
+
+#define DTYPE Symbol
+#define QTYPE String
+#define D_HASH(d) (hashString((d)->name, (d)->name_len))
+#define Q_HASH(q) (hashString((q)->d, (q)->len))
+// Names live in the table's arena
+#define DELETE(d) {}
+#define VALID(d) ((d).name)
+#define EQ(d,q) (EQUALS((*q),(d).name,(d).name_len))
+#include "hash-map.h"
+
+// Interns identifiers as dense ids, so each occurrence of a name is hashed and compared once, when
+// it is lexed. Everything the assembler knows about a name is kept in arrays indexed by its id.
+typedef struct SymbolTable {
+	SymbolMap  map;
+	String    *names;			// Name of each symbol; names[NO_SYMBOL] is empty
+	int64_t   *constant_value;	// Value of the constant with the symbol's name
+	uint32_t  *constant_line;	// Line the constant is defined on, or 0 if the name is not a constant
+	size_t     num_symbols;
+	size_t     capacity;
+	Arena      arena;			// Holds the names
+} SymbolTable;
+
+void symbolTableInit(SymbolTable *s) {
+	SymbolMapInit(&s->map);
+	arenaInit(&s->arena);
+	s->capacity = SYMBOL_START_SIZE;
+	s->names = malloc(s->capacity * sizeof(String));
+	s->constant_value = malloc(s->capacity * sizeof(int64_t));
+	s->constant_line = malloc(s->capacity * sizeof(uint32_t));
+	s->names[NO_SYMBOL].d = "";
+	s->names[NO_SYMBOL].len = 0;
+	s->constant_line[NO_SYMBOL] = 0;
+	s->num_symbols = 1;
+}
+
+void symbolTableFree(SymbolTable *s) {
+	SymbolMapFree(&s->map);
+	arenaFree(&s->arena);
+	free(s->names);
+	free(s->constant_value);
+	free(s->constant_line);
+}
+
+// Makes room for n symbols, so interning up to n names does not grow the table
+void symbolTableReserve(SymbolTable *s, size_t n) {
+	SymbolMapReserve(&s->map, n);
+	if (n > s->capacity) {
+		s->capacity = n;
+		s->names = realloc(s->names, s->capacity * sizeof(String));
+		s->constant_value = realloc(s->constant_value, s->capacity * sizeof(int64_t));
+		s->constant_line = realloc(s->constant_line, s->capacity * sizeof(uint32_t));
+	}
+}
+
+/*
+ * Finds the id of a name, adding the name to the table the first time it is seen
+ * Param s:   The table
+ * Param d:   The name
+ * Param len: Length of the name
+ * Returns:   The name's id
+ */
+uint32_t symbolIntern(SymbolTable *s, char *d, size_t len) {
+	String name = {d, len};
+	Symbol *found = SymbolMapGet(&s->map, &name);
+	if (found) {
+		return found->id;
+	}
+	if (s->num_symbols == s->capacity) {
+		s->capacity <<= 1;
+		s->names = realloc(s->names, s->capacity * sizeof(String));
+		s->constant_value = realloc(s->constant_value, s->capacity * sizeof(int64_t));
+		s->constant_line = realloc(s->constant_line, s->capacity * sizeof(uint32_t));
+	}
+	uint32_t id = s->num_symbols++;
+	Symbol symbol;
+	symbol.name = arenaCopy(&s->arena, d, len);
+	symbol.name_len = len;
+	symbol.id = id;
+	s->names[id].d = symbol.name;
+	s->names[id].len = len;
+	s->constant_line[id] = 0;
+	SymbolMapInsert(&s->map, &symbol);
+	return id;
+}
+
+// Finds the id of a name without adding it, or returns NO_SYMBOL if the table does not have it
+uint32_t symbolFind(SymbolTable *s, String *name) {
+	Symbol *found = SymbolMapGet(&s->map, name);
+	return found ? found->id : NO_SYMBOL;
+}
@@ -0,0 +1,6 @@
+; A constant is range checked like a literal, except by mov to a 64 bit register
+[bits 64]
+K equ 0xFFFFFFFF
+	mov rax, K
+	add eax, K
+	add rax, K
@@ -0,0 +1,4 @@
+; Long mode moves control registers to and from 64 bit registers only
+[bits 64]
+	mov cr3, rax
+	mov cr3, eax
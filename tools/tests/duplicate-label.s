@@ -0,0 +1,6 @@
+; A label defined twice
+[bits 64]
+here:
+	dec eax
+here:
+	jnz here
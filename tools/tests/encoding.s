@@ -0,0 +1,36 @@
+; REX prefixes, SIB bytes and 8 bit displacements, without -O
+[bits 64]
+	mov rax, rbx
+	mov r8, r9
+	mov r12d, eax
+	add r15, rcx
+	xor sil, dil
+	mov ax, bx
+	dec r10
+	mov [rax], ebx
+	mov [r8], rcx
+	mov [rsp], eax
+	mov [r12], eax
+	mov [rbp], eax
+	mov [r13], eax
+	mov [eax], ebx
+	mov DWORD [rdi], 7
+	mov BYTE [rbx], 1
+	add eax, 5
+	add rbx, 5
+	mov rax, 0
+	mov rax, 0x123456789
+	mov cr3, rax
+	mov rax, cr0
+	rep stosq
+	rdmsr
+[bits 32]
+	mov eax, ebx
+	mov [esp], ecx
+	mov [ebp], edx
+	mov DWORD [esi], 0x12345678
+	add ecx, 300
+	mov ecx, cr4
+	dq 0x1122334455667788
+_start:
+	jmp _start
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Stress test for jump relaxation without align directives, which takes the worklist path. Generated
+# sources interleave short, medium and far jmp and jnz in both directions, so jumps widen both while
+# parsing (far backward) and while relaxing. Each must assemble to the same bytes as the same source
+# with a trailing "align 1", which relaxes with whole passes instead, and as -j 4, and every jump's
+# displacement in the listing must land on the address the symbol map gives its label.
+# Usage: jumps.sh ASSEMBLER
+
+assembler=$1
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+
+failed=0
+for seed in 1 2 3 4; do
+	awk -v seed="$seed" -v lines=40000 'BEGIN {
+		srand(seed)
+		split("dec eax|mov eax, ebx|dd 0x12345678|dq 1|db 1", fillers, "|")
+		print "[bits 64]"
+		labels = 0
+		last = 0
+		for (i = 0; i < lines; i++) {
+			r = rand()
+			if (r < 0.12) {
+				print "L" labels++ ":"
+				continue
+			}
+			if (r >= 0.5) {
+				print "\t" fillers[int(rand() * 5) + 1]
+				continue
+			}
+			# Mostly short distances, some around the short range limit, and a few far
+			d = rand()
+			distance = d < 0.6 ? 1 + int(rand() * 6) : d < 0.9 ? 10 + int(rand() * 50) : 200 + int(rand() * 3000)
+			target = rand() < 0.5 ? labels - distance : labels + distance - 1
+			if (target < 0) target = 0
+			if (target > last) last = target
+			print "\t" (rand() < 0.5 ? "jmp" : "jnz") " L" target
+		}
+		for (; labels <= last; labels++) print "L" labels ":"
+	}' > "$scratch/jumps.s"
+	{ cat "$scratch/jumps.s"; printf '\talign 1\n'; } > "$scratch/aligned.s"
+
+	same=1
+	if ! "$assembler" "$scratch/jumps.s" -o "$scratch/serial.elf" -l "$scratch/jumps.lst" -m "$scratch/jumps.map"; then
+		echo "FAIL seed $seed: serial run"
+		failed=1
+		continue
+	fi
+	for run in "-j 4 $scratch/jumps.s" "$scratch/aligned.s"; do
+		if ! "$assembler" $run -o "$scratch/out.elf" || ! cmp -s "$scratch/serial.elf" "$scratch/out.elf"; then
+			echo "FAIL seed $seed: $run differs from the serial run"
+			same=0
+		fi
+	done
+
+	# Decodes each jump in the listing and checks its target against the symbol map
+	if ! awk '
+		function hex(s,    n, i) {
+			for (i = 1; i <= length(s); i++) n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1
+			return n
+		}
+		FNR == NR { if (FNR > 1) address[$3] = hex($1); next }
+		$4 == "jmp" || $4 == "jnz" {
+			at = hex($2)
+			code = $3
+			if (code ~ /^(EB|75)/) { size = 2; disp = hex(substr(code, 3, 2)); if (disp >= 128) disp -= 256 }
+			else {
+				size = code ~ /^E9/ ? 5 : 6
+				disp = 0
+				for (b = 3; b >= 0; b--) disp = disp * 256 + hex(substr(code, 2 * (size - 4 + b) + 1, 2))
+				if (disp >= 2147483648) disp -= 4294967296
+			}
+			jumps++
+			if (at + size + disp != address[$5]) {
+				if (wrong++ < 5) print "wrong target: " $0
+			}
+		}
+		END { if (wrong || !jumps) exit 1 }
+	' "$scratch/jumps.map" "$scratch/jumps.lst"; then
+		echo "FAIL seed $seed: jumps that miss their labels"
+		same=0
+	fi
+
+	if [ $same -eq 1 ]; then
+		echo "ok   seed $seed"
+	else
+		failed=1
+	fi
+done
+exit $failed
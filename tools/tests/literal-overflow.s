@@ -0,0 +1,4 @@
+; A 64 bit operation's immediate must fit in a sign extended 32 bits
+[bits 64]
+	add rax, 0x7FFFFFFF
+	add rax, 0x80000000
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Checks that serial, parallel and cached runs assemble the same bytes from generated sources with
+# align directives. The sources are generated, since -j only splits sources of several chunks.
+# Usage: modes.sh ASSEMBLER GEN_SOURCE
+
+assembler=$1
+gen_source=$2
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+
+failed=0
+for seed in 1 2 3 4; do
+	# An align of 2 to 64 bytes before about one line in a hundred
+	"$gen_source" 30000 "$seed" | awk 'NR > 1 && NR % 97 == 0 { print "\talign " 2 ^ (NR % 6 + 1) } { print }' \
+		> "$scratch/source.s"
+	"$assembler" "$scratch/source.s" -o "$scratch/serial.elf" || { echo "FAIL seed $seed: serial run"; failed=1; continue; }
+	rm -f "$scratch/cache"
+	same=1
+	# The cache is written by the first --cache run and read by the second
+	for flags in "-j 2" "-j 3" "-j 4" "-j 8" "--cache=$scratch/cache" "--cache=$scratch/cache"; do
+		if ! "$assembler" $flags "$scratch/source.s" -o "$scratch/out.elf" \
+		   || ! cmp -s "$scratch/serial.elf" "$scratch/out.elf"; then
+			echo "FAIL seed $seed: $flags differs from the serial run"
+			same=0
+		fi
+	done
+	if [ $same -eq 1 ]; then
+		echo "ok   seed $seed"
+	else
+		failed=1
+	fi
+done
+exit $failed
@@ -0,0 +1,21 @@
+; flags: -O
+; Sign extended 8 bit immediates, the xor zero idiom and shorter 64 bit moves
+[bits 64]
+_start:
+	add eax, 5
+	add rbx, -8
+	and cx, 0x7F
+	or r9d, 128
+	mov eax, 0
+	add ebx, 1
+	mov rax, 0
+	xor ecx, ecx
+	mov edx, 0
+	jnz _start
+	mov rax, 0x12345678
+	mov r10, -1
+	mov rdx, 0x123456789
+[bits 32]
+	xor eax, 100
+	mov esi, 0
+	dec esi
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Assembles every fixture in this directory and compares the result with the expected output next to it.
+# Usage: run.sh ASSEMBLER
+# NAME.s with NAME.hex must assemble to exactly the bytes listed in NAME.hex (od -An -tx1 -v of the ELF).
+# NAME.s with NAME.err must fail, printing exactly NAME.err on stderr.
+# A "; flags: ..." line in a fixture passes those flags to the assembler.
+# Run with UPDATE=1 to rewrite the expected files from the current assembler, then review the diff.
+
+assembler=$(realpath "$1")
+cd "$(dirname "$0")" || exit 1
+scratch=$(mktemp -d) || exit 1
+trap 'rm -rf "$scratch"' EXIT
+
+failed=0
+for source in *.s; do
+	name=${source%.s}
+	flags=$(sed -n 's/^; flags: *//p' "$source")
+	"$assembler" $flags "$source" -o "$scratch/out.elf" 2> "$scratch/err"
+	status=$?
+	if [ -f "$name.err" ]; then
+		if [ -n "$UPDATE" ]; then
+			cp "$scratch/err" "$name.err"
+		elif [ $status -eq 0 ]; then
+			echo "FAIL $source: assembled, expected an error"
+			failed=1
+			continue
+		elif ! diff -u "$name.err" "$scratch/err"; then
+			echo "FAIL $source: wrong error"
+			failed=1
+			continue
+		fi
+	else
+		if [ $status -ne 0 ]; then
+			cat "$scratch/err"
+			echo "FAIL $source: exit status $status"
+			failed=1
+			continue
+		fi
+		od -An -tx1 -v "$scratch/out.elf" > "$scratch/out.hex"
+		if [ -n "$UPDATE" ]; then
+			cp "$scratch/out.hex" "$name.hex"
+		elif ! diff -u "$name.hex" "$scratch/out.hex"; then
+			echo "FAIL $source: wrong bytes"
+			failed=1
+			continue
+		fi
+	fi
+	echo "ok   $source"
+done
+exit $failed
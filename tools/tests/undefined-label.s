@@ -0,0 +1,6 @@
+; A jump to a label that is never defined
+[bits 64]
+start:
+	dec eax
+	jnz start
+	jmp missing
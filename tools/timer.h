@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <time.h>
+
+#define TIMER_MAX_PHASES 0x10
+
+// Wall clock time spent in each consecutive phase of a run
+typedef struct PhaseTimer {
+	const char *names[TIMER_MAX_PHASES];
+	double      seconds[TIMER_MAX_PHASES];
+	size_t      num_phases;
+	double      last;		// When the current phase started
+} PhaseTimer;
+
+static inline double timerNow() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void timerStart(PhaseTimer *t) {
+	t->num_phases = 0;
+	t->last = timerNow();
+}
+
+// Ends the current phase, recording the time since the previous one ended under name
+void timerPhase(PhaseTimer *t, const char *name) {
+	double now = timerNow();
+	if (t->num_phases < TIMER_MAX_PHASES) {
+		t->names[t->num_phases] = name;
+		t->seconds[t->num_phases++] = now - t->last;
+	}
+	t->last = now;
+}
+
+void timerPrint(PhaseTimer *t, FILE *f) {
+	for (size_t i = 0; i < t->num_phases; i++) {
+		fprintf(f, "Phase %s: %.6f s\n", t->names[i], t->seconds[i]);
+	}
+}